@@ -0,0 +1,465 @@
+// batch.cpp
+//
+//
+/*
+    Copyright (C) 2012 Jason Summers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    See the file tweakpng-src.txt for more information.
+*/
+
+// Loading and saving many files at once.
+//
+// BatchLoader opens files on a group of threads, so that many reads can be
+// outstanding at the same time, instead of waiting for each file in turn.
+// The total size of the files that are being loaded, or that have been
+// loaded but not yet collected by get_next(), is limited to max_bytes
+// (except that one file is always allowed, no matter how big).
+//
+// BatchSaver saves files so that a crash leaves each one either as it was
+// or completely written. Each file is written to a temporary file in the
+// same directory. The temporary files are flushed to disk a group at a
+// time, with all the flushes outstanding at once, and only then renamed
+// over the real files. That costs much less than writing, flushing and
+// renaming each file in turn.
+
+#include "twpng-config.h"
+
+#include <windows.h>
+#include <tchar.h>
+#include <process.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "resource.h"
+#include "tweakpng.h"
+#include <strsafe.h>
+
+extern struct globals_struct globals;
+
+struct twpng_batch_job {
+	TCHAR fn[MAX_PATH];
+	ULONGLONG size;
+	Png *png;
+	int num_messages;
+	TCHAR message[256];
+};
+
+// If num_threads is 0, a reasonable number is chosen.
+BatchLoader::BatchLoader(int num_threads, ULONGLONG max_bytes, unsigned int loadflags)
+{
+	SYSTEM_INFO si;
+
+	if(num_threads<1) {
+		// Most of the time will be spent waiting for the disk, so use
+		// more threads than processors.
+		GetSystemInfo(&si);
+		num_threads = 2*(int)si.dwNumberOfProcessors;
+	}
+	if(num_threads>TWPNG_BATCH_MAX_THREADS) num_threads=TWPNG_BATCH_MAX_THREADS;
+
+	m_num_threads=num_threads;
+	m_max_bytes=max_bytes;
+	m_loadflags=loadflags;
+
+	m_jobs=NULL;
+	m_num_jobs=0;
+	m_jobs_alloc=0;
+	m_next_job=0;
+	m_done=NULL;
+	m_num_done=0;
+	m_num_taken=0;
+	m_bytes_in_flight=0;
+	m_started=0;
+	m_cancel=0;
+	m_threads=NULL;
+
+	InitializeCriticalSection(&m_lock);
+	m_budget_event=CreateEvent(NULL,TRUE,TRUE,NULL);
+	m_done_sem=NULL;
+}
+
+BatchLoader::~BatchLoader()
+{
+	int i;
+
+	if(m_started) {
+		// Stop the threads from starting any more files, and wait for them.
+		EnterCriticalSection(&m_lock);
+		m_cancel=1;
+		SetEvent(m_budget_event);
+		LeaveCriticalSection(&m_lock);
+
+		for(i=0;i<m_num_threads;i++) {
+			if(m_threads[i]) {
+				WaitForSingleObject(m_threads[i],INFINITE);
+				CloseHandle(m_threads[i]);
+			}
+		}
+		free(m_threads);
+
+		// Delete anything that the caller didn't collect.
+		for(i=m_num_taken;i<m_num_done;i++) {
+			if(m_jobs[m_done[i]].png) delete m_jobs[m_done[i]].png;
+		}
+	}
+
+	if(m_jobs) free(m_jobs);
+	if(m_done) free(m_done);
+	if(m_budget_event) CloseHandle(m_budget_event);
+	if(m_done_sem) CloseHandle(m_done_sem);
+	DeleteCriticalSection(&m_lock);
+}
+
+// Add a file to be loaded. Must be called before start().
+// Returns the file's index, or -1 on failure.
+int BatchLoader::add(const TCHAR *fn)
+{
+	struct twpng_batch_job *newjobs;
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+
+	if(m_started) return -1;
+
+	if(m_num_jobs>=m_jobs_alloc) {
+		newjobs=(struct twpng_batch_job*)realloc((void*)m_jobs,
+			(m_jobs_alloc+200)*sizeof(struct twpng_batch_job));
+		if(!newjobs) return -1;
+		m_jobs=newjobs;
+		m_jobs_alloc+=200;
+	}
+
+	ZeroMemory((void*)&m_jobs[m_num_jobs],sizeof(struct twpng_batch_job));
+	StringCchCopy(m_jobs[m_num_jobs].fn,MAX_PATH,fn);
+
+	// If we can't get the size, count it as 0. Loading it will fail anyway.
+	if(GetFileAttributesEx(fn,GetFileExInfoStandard,(LPVOID)&fad)) {
+		m_jobs[m_num_jobs].size = ((ULONGLONG)fad.nFileSizeHigh<<32) | fad.nFileSizeLow;
+	}
+	// When probing, usually only the start of the file is read.
+	if((m_loadflags & TWPNG_LOAD_PROBE) && m_jobs[m_num_jobs].size>TWPNG_PROBE_BUFSIZE) {
+		m_jobs[m_num_jobs].size = TWPNG_PROBE_BUFSIZE;
+	}
+
+	return m_num_jobs++;
+}
+
+// Start loading the files.
+// Returns 0 on failure, in which case get_next() shouldn't be called.
+int BatchLoader::start()
+{
+	int i;
+
+	if(m_started) return 0;
+
+	m_done=(int*)malloc((m_num_jobs>0?m_num_jobs:1)*sizeof(int));
+	m_threads=(HANDLE*)calloc(m_num_threads,sizeof(HANDLE));
+	m_done_sem=CreateSemaphore(NULL,0,m_num_jobs>0?m_num_jobs:1,NULL);
+	if(!m_done || !m_threads || !m_done_sem || !m_budget_event) {
+		if(m_threads) { free(m_threads); m_threads=NULL; }
+		return 0;
+	}
+
+	m_started=1;
+	for(i=0;i<m_num_threads;i++) {
+		m_threads[i]=(HANDLE)_beginthreadex(NULL,0,thread_fn,(void*)this,0,NULL);
+		if(!m_threads[i]) {
+			if(i==0) {
+				// No threads, so nothing would ever get loaded.
+				free(m_threads);
+				m_threads=NULL;
+				m_started=0;
+				return 0;
+			}
+			m_num_threads=i;
+			break;
+		}
+	}
+	return 1;
+}
+
+unsigned __stdcall BatchLoader::thread_fn(void *param)
+{
+	((BatchLoader*)param)->run();
+	return 0;
+}
+
+// The main function of each thread.
+void BatchLoader::run()
+{
+	struct twpng_batch_job *job;
+	int n;
+
+	// Keep warnings to ourselves; they're returned with the results.
+	twpng_set_quiet_mesg(1);
+
+	while(1) {
+		EnterCriticalSection(&m_lock);
+		if(m_cancel || m_next_job>=m_num_jobs) {
+			LeaveCriticalSection(&m_lock);
+			break;
+		}
+		n=m_next_job++;
+		job=&m_jobs[n];
+
+		// Wait until there's room for this file.
+		while(!m_cancel && m_bytes_in_flight>0 &&
+			m_bytes_in_flight + job->size > m_max_bytes)
+		{
+			ResetEvent(m_budget_event);
+			LeaveCriticalSection(&m_lock);
+			WaitForSingleObject(m_budget_event,INFINITE);
+			EnterCriticalSection(&m_lock);
+		}
+		if(m_cancel) {
+			LeaveCriticalSection(&m_lock);
+			break;
+		}
+		m_bytes_in_flight += job->size;
+		LeaveCriticalSection(&m_lock);
+
+		twpng_reset_quiet_mesg();
+		job->png = new Png(job->fn, job->fn, m_loadflags);
+		if(!job->png->m_valid) {
+			delete job->png;
+			job->png=NULL;
+		}
+		job->num_messages = twpng_get_quiet_mesg(job->message,256);
+
+		EnterCriticalSection(&m_lock);
+		m_done[m_num_done++] = n;
+		LeaveCriticalSection(&m_lock);
+		ReleaseSemaphore(m_done_sem,1,NULL);
+	}
+}
+
+// Wait for the next file to finish loading (in whatever order they finish),
+// and return it in *res. The caller is responsible for deleting res->png.
+// res->fn is valid until the BatchLoader is deleted.
+// Returns 0 if there are no more files.
+int BatchLoader::get_next(struct twpng_batch_result *res)
+{
+	struct twpng_batch_job *job;
+
+	if(!m_started || m_num_taken>=m_num_jobs) return 0;
+
+	WaitForSingleObject(m_done_sem,INFINITE);
+
+	EnterCriticalSection(&m_lock);
+	res->index = m_done[m_num_taken++];
+	job = &m_jobs[res->index];
+	res->fn = job->fn;
+	res->png = job->png;
+	res->num_messages = job->num_messages;
+	StringCchCopy(res->message,256,job->message);
+	job->png = NULL;
+
+	// The caller has it now, so it no longer counts against our limit.
+	m_bytes_in_flight -= job->size;
+	SetEvent(m_budget_event);
+	LeaveCriticalSection(&m_lock);
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////
+
+struct twpng_save_job {
+	TCHAR fn[MAX_PATH];
+	TCHAR tmpfn[MAX_PATH];
+	HANDLE fh;          // the temporary file, until the group is committed
+	int flush_failed;
+	int ok;
+	TCHAR message[256];
+	BatchSaver *saver;
+};
+
+// If group_size is 0, TWPNG_SAVE_GROUP is used.
+BatchSaver::BatchSaver(int group_size)
+{
+	if(group_size<1) group_size=TWPNG_SAVE_GROUP;
+	m_group_size=group_size;
+	m_jobs=NULL;
+	m_num_jobs=0;
+	m_jobs_alloc=0;
+	m_group_start=0;
+	m_pending=0;
+	m_done_event=CreateEvent(NULL,TRUE,FALSE,NULL);
+}
+
+// Files that were added but not committed by finish() are not saved.
+BatchSaver::~BatchSaver()
+{
+	int i;
+
+	for(i=m_group_start;i<m_num_jobs;i++) {
+		if(m_jobs[i].fh!=INVALID_HANDLE_VALUE) {
+			CloseHandle(m_jobs[i].fh);
+			DeleteFile(m_jobs[i].tmpfn);
+		}
+	}
+	if(m_jobs) free(m_jobs);
+	if(m_done_event) CloseHandle(m_done_event);
+}
+
+void BatchSaver::set_failed(struct twpng_save_job *job, const TCHAR *msg, const TCHAR *fn)
+{
+	job->ok=0;
+	StringCchPrintf(job->message,256,msg,fn);
+}
+
+// Write png to a temporary file, to be renamed to fn when its group is
+// committed. This may commit a group, so it can take a while. The Png isn't
+// needed after this returns. Messages about the file are not shown; they're
+// returned by get_result().
+// Returns the file's index, or -1 on failure.
+int BatchSaver::add(Png *png, const TCHAR *fn)
+{
+	struct twpng_save_job *newjobs;
+	struct twpng_save_job *job;
+	TCHAR dir[MAX_PATH];
+	TCHAR *base;
+	struct twpng_quiet_state qs;
+	int index;
+
+	if(m_num_jobs>=m_jobs_alloc) {
+		newjobs=(struct twpng_save_job*)realloc((void*)m_jobs,
+			(m_jobs_alloc+200)*sizeof(struct twpng_save_job));
+		if(!newjobs) return -1;
+		m_jobs=newjobs;
+		m_jobs_alloc+=200;
+	}
+
+	index=m_num_jobs++;
+	job=&m_jobs[index];
+	ZeroMemory((void*)job,sizeof(struct twpng_save_job));
+	StringCchCopy(job->fn,MAX_PATH,fn);
+	job->fh=INVALID_HANDLE_VALUE;
+	job->saver=this;
+
+	// The temporary file has to be on the same volume, for the rename.
+	if(!GetFullPathName(fn,MAX_PATH,dir,&base) || !base) {
+		set_failed(job,_T("Can") SYM_RSQUO _T("t write file (%s)"),fn);
+		goto done;
+	}
+	*base='\0';  // chop off the filename
+
+	if(!GetTempFileName(dir,_T("twp"),0,job->tmpfn)) {
+		set_failed(job,_T("Can") SYM_RSQUO _T("t create a temporary file in %s"),dir);
+		goto done;
+	}
+	job->fh=CreateFile(job->tmpfn,GENERIC_WRITE,0,NULL,CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,NULL);
+	if(job->fh==INVALID_HANDLE_VALUE) {
+		DeleteFile(job->tmpfn);
+		set_failed(job,_T("Can") SYM_RSQUO _T("t write file (%s)"),job->tmpfn);
+		goto done;
+	}
+
+	// Collect the messages for this file, without disturbing our caller's.
+	twpng_push_quiet_mesg(&qs);
+	if(!png->write_to_handle(job->fh)) {
+		CloseHandle(job->fh);
+		job->fh=INVALID_HANDLE_VALUE;
+		DeleteFile(job->tmpfn);
+		if(!twpng_get_quiet_mesg(job->message,256))
+			set_failed(job,_T("Error writing file (%s)"),fn);
+	}
+	twpng_pop_quiet_mesg(&qs);
+
+done:
+	if(m_num_jobs-m_group_start>=m_group_size) commit_group();
+	return index;
+}
+
+DWORD WINAPI BatchSaver::flush_fn(LPVOID param)
+{
+	struct twpng_save_job *job = (struct twpng_save_job*)param;
+
+	if(!FlushFileBuffers(job->fh)) job->flush_failed=1;
+	if(InterlockedDecrement(&job->saver->m_pending)==0) {
+		SetEvent(job->saver->m_done_event);
+	}
+	return 0;
+}
+
+// Flush all the uncommitted temporary files to disk, then rename them.
+// The data of every file in the group is on disk before any of them
+// replaces a real file.
+void BatchSaver::commit_group()
+{
+	struct twpng_save_job *job;
+	int i;
+
+	// Start all the flushes at once, so that the disk can combine them.
+	m_pending=1;  // our own reference, released below
+	if(m_done_event) ResetEvent(m_done_event);
+	for(i=m_group_start;i<m_num_jobs;i++) {
+		job=&m_jobs[i];
+		if(job->fh==INVALID_HANDLE_VALUE) continue;
+		if(m_done_event) {
+			InterlockedIncrement(&m_pending);
+			if(QueueUserWorkItem(flush_fn,(PVOID)job,WT_EXECUTEDEFAULT)) continue;
+			InterlockedDecrement(&m_pending);
+		}
+		if(!FlushFileBuffers(job->fh)) job->flush_failed=1;
+	}
+	if(InterlockedDecrement(&m_pending)>0) {
+		WaitForSingleObject(m_done_event,INFINITE);
+	}
+
+	for(i=m_group_start;i<m_num_jobs;i++) {
+		job=&m_jobs[i];
+		if(job->fh==INVALID_HANDLE_VALUE) continue;
+		CloseHandle(job->fh);
+		job->fh=INVALID_HANDLE_VALUE;
+
+		if(job->flush_failed) {
+			DeleteFile(job->tmpfn);
+			set_failed(job,_T("Error writing file (%s)"),job->fn);
+			continue;
+		}
+		twpng_copy_file_attributes(job->fn,job->tmpfn);
+		if(!MoveFileEx(job->tmpfn,job->fn,MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH)) {
+			DeleteFile(job->tmpfn);
+			set_failed(job,_T("Can") SYM_RSQUO _T("t replace file (%s)"),job->fn);
+			continue;
+		}
+		job->ok=1;
+	}
+	m_group_start=m_num_jobs;
+}
+
+// Commit the files that haven't been committed yet.
+// Returns the number of files (of all that were added) that weren't saved.
+int BatchSaver::finish()
+{
+	int num_failed=0;
+	int i;
+
+	commit_group();
+	for(i=0;i<m_num_jobs;i++) {
+		if(!m_jobs[i].ok) num_failed++;
+	}
+	return num_failed;
+}
+
+// Get the outcome for the file that add() gave this index to.
+// Returns 0 if there's no such file, or it hasn't been committed yet.
+int BatchSaver::get_result(int index, struct twpng_save_result *res)
+{
+	if(index<0 || index>=m_group_start) return 0;
+	res->ok = m_jobs[index].ok;
+	StringCchCopy(res->message,256,m_jobs[index].message);
+	return 1;
+}
@@ -133,6 +133,7 @@ static const chunk_id_struct_t chunk_id_list[] = {
 	{CHUNK_fdAT,"fdAT"},
 	{CHUNK_CgBI,"CgBI"},
 	{CHUNK_vpAg,"vpAg"},
+	{CHUNK_twPd,"twPd"},
 
 	{CHUNK_MHDR,"MHDR"},
 	{CHUNK_MEND,"MEND"},
@@ -395,6 +396,7 @@ static void crlf2lf(TCHAR *outdata)
 	outdata[len-d]='\0';
 }
 
+// Returns 0 if the data couldn't be read (see TWPNG_LOAD_LAZY).
 int Chunk::copy_to_memory(unsigned char *m)
 {
 #if 0
@@ -403,8 +405,7 @@ int Chunk::copy_to_memory(unsigned char *m)
 	memcpy(&m[8],data,length);
 	write_int32(&m[8+length],m_crc);
 #endif
-	copy_segment_to_memory(m,0,length+12);
-	return 1;
+	return (copy_segment_to_memory(m,0,length+12)==length+12) ? 1 : 0;
 }
 
 // We maintain both an ASCII and a TCHAR (optionally Unicode)
@@ -423,7 +424,7 @@ int Chunk::init_from_memory(unsigned char *m, int msize)
 	if(msize<12) return 0;
 
 	length= read_int32(&m[0]);
-	if((int)length+12>msize) return 0;
+	if(length>TWPNG_MAX_CHUNK_LENGTH || (int)length+12>msize) return 0;
 
 	memcpy(m_chunktype_ascii,&m[4],4);
 	m_chunktype_ascii[4]='\0';
@@ -435,10 +436,10 @@ int Chunk::init_from_memory(unsigned char *m, int msize)
 		return 0;
 	}
 	memcpy(data,&m[8],length);
-	// crc is next, but we'll ignore it
+	// crc is next, but we'll ignore it. The caller has to calculate it
+	// (by calling chunkmodified(), or calc_chunk_crcs() for many chunks).
 
 	after_init();
-	chunkmodified();
 
 	return length+12;
 }
@@ -563,6 +564,11 @@ int Chunk::edit_plte_info()
 		DlgProcEdit_PLTE, (LPARAM)(&pal_info));
 	globals.dlgs_open--;
 	if(changed>0) {
+		// These may be borrowed from a mapped file, which is read-only.
+		if(ch_bkgd) ch_bkgd->make_data_private();
+		if(ch_trns) ch_trns->make_data_private();
+		if(ch_plte) ch_plte->make_data_private();
+
 		if(ch_bkgd) {
 			if(grayscale) {
 				write_int16(&ch_bkgd->data[0],pal_info.bkgd);
@@ -581,7 +587,7 @@ int Chunk::edit_plte_info()
 			else {
 				if(ch_trns->length != (unsigned int)pal_info.numtrns) {
 					// size of alpha palette changed, need to reallocate
-					free(ch_trns->data);
+					ch_trns->free_data();
 					ch_trns->data=(unsigned char*)malloc(pal_info.numtrns);
 					ch_trns->length=(unsigned int)pal_info.numtrns;
 				}
@@ -594,7 +600,7 @@ int Chunk::edit_plte_info()
 		if(ch_plte) {
 			if(ch_plte->length != (unsigned int)(3*pal_info.numplte) ) {
 				// size of palette changed, need to reallocate
-				free(ch_plte->data);
+				ch_plte->free_data();
 				ch_plte->data=(unsigned char*)malloc(3*pal_info.numplte);
 				ch_plte->length=(unsigned int)(3*pal_info.numplte);
 			}
@@ -644,6 +650,15 @@ int Chunk::edit()
 	if(!has_valid_length()) return 0;
 	ZeroMemory((void*)&ecctx,sizeof(struct edit_chunk_ctx));
 	ecctx.ch = this;
+	if(m_chunktype_id==CHUNK_fdAT) {
+		// Only the sequence number can be edited, so don't copy the frame
+		// data unless it changes.
+		if(!get_data_segment(0,ecctx.seqbuf,4)) return 0;
+	}
+	else {
+		// The editors modify 'data' in place.
+		if(!make_data_private()) return 0;
+	}
 
 	globals.dlgs_open++;
 
@@ -800,7 +815,15 @@ plte_start:
 		break;
 	}
 
-	if(changed>0) chunkmodified();    // update crc
+	if(changed>0) {
+		if(m_chunktype_id==CHUNK_fdAT) {
+			// The crc is updated from the changed bytes alone.
+			if(!overwrite_data(0,ecctx.seqbuf,4)) changed=0;
+		}
+		else {
+			chunkmodified();    // update crc
+		}
+	}
 	globals.dlgs_open--;
 	return (int)changed;
 }
@@ -809,18 +832,244 @@ plte_start:
 void Chunk::chunkmodified()
 {
 	m_crc=calc_crc();
+	m_crc_unverified=0;
+}
+
+// Compare the crc that was read from the file to the calculated crc.
+// If they don't match, warn about it, and correct it.
+void Chunk::verify_crc()
+{
+	check_crc(calc_crc());
+}
+
+void Chunk::check_crc(DWORD ccrc)
+{
+	m_crc_unverified=0;
+
+	if(m_crc != ccrc) {
+		m_file_stale=1;  // what's in the file is wrong, even if we don't change the crc
+		if(globals.repair_crc && repair_bit_errors(ccrc)) return;
+		mesg(MSG_W,_T("Incorrect crc for %s chunk (is %08x, should be %08x)"),
+			m_chunktype_tchar, m_crc, ccrc);
+		m_crc=ccrc;  // correct it
+	}
+}
+
+// The crc doesn't match the data (ccrc is the crc of the data). If that
+// can be explained by 1 or 2 flipped bits in the data or the stored crc,
+// flip them back and report what was changed. Errors in the chunk type
+// aren't repaired.
+// Returns 1 if the chunk was repaired.
+int Chunk::repair_bit_errors(DWORD ccrc)
+{
+	ULONGLONG bitpos[2];
+	TCHAR desc[2][80];
+	DWORD datapos;
+	int nbits;
+	int i;
+
+	nbits=find_crc_bit_errors(m_crc,ccrc,4+length,bitpos);
+	if(nbits<1) return 0;
+
+	for(i=0;i<nbits;i++) {
+		if(bitpos[i]<32) return 0;
+	}
+	if(!make_data_private()) return 0;
+
+	for(i=0;i<nbits;i++) {
+		if(bitpos[i] >= (ULONGLONG)(4+length)*8) {
+			m_crc ^= (DWORD)1 << (int)(bitpos[i]-(ULONGLONG)(4+length)*8);
+			StringCchPrintf(desc[i],80,_T("bit %d of the crc"),
+				(int)(bitpos[i]-(ULONGLONG)(4+length)*8));
+		}
+		else {
+			datapos = (DWORD)(bitpos[i]/8) - 4;
+			data[datapos] ^= (unsigned char)(1 << (int)(bitpos[i]%8));
+			StringCchPrintf(desc[i],80,_T("bit %d of byte %u"),(int)(bitpos[i]%8),datapos);
+		}
+	}
+
+	if(nbits==1) {
+		mesg(MSG_W,_T("Incorrect crc for %s chunk. Repaired a 1-bit error: %s."),
+			m_chunktype_tchar,desc[0]);
+	}
+	else {
+		mesg(MSG_W,_T("Incorrect crc for %s chunk. Repaired a 2-bit error: %s, and %s."),
+			m_chunktype_tchar,desc[0],desc[1]);
+	}
+	return 1;
+}
+
+// If our data is borrowed from a file mapping, or hasn't been read yet,
+// replace it with a private copy, so that it can be modified, or can
+// outlive the source file.
+// Returns 0 on failure.
+int Chunk::make_data_private()
+{
+	unsigned char *newdata;
+
+	if(!m_data_mapped && !m_data_deferred) return 1;
+
+	newdata=(unsigned char*)malloc(length);
+	if(!newdata) {
+		mesg(MSG_S,_T("Can") SYM_RSQUO _T("t allocate memory for chunk"));
+		return 0;
+	}
+	if(!get_data_segment(0,newdata,length)) {
+		free(newdata);
+		return 0;
+	}
+	data=newdata;
+	m_data_mapped=0;
+	m_data_deferred=0;
+
+	// Now that it's in memory, checking the crc is cheap.
+	if(m_crc_unverified) verify_crc();
+	return 1;
+}
+
+// Use this instead of free(data), in case data is borrowed from a file mapping.
+void Chunk::free_data()
+{
+	if(data && !m_data_mapped) free(data);
+	data=NULL;
+	m_data_mapped=0;
+	m_data_deferred=0;
+}
+
+// Copy part of the chunk's data into buf, reading it from the source file
+// if necessary. Does not read the whole chunk into memory.
+int Chunk::get_data_segment(DWORD offset, unsigned char *buf, DWORD len)
+{
+	if(len==0) return 1;
+	if(offset>length || len>length-offset) return 0;
+
+	if(m_data_deferred) {
+		return m_parentpng->read_source(m_srcpos+offset,buf,len);
+	}
+	memcpy(buf,&data[offset],len);
+	return 1;
 }
 
 DWORD Chunk::calc_crc()
 {
 	DWORD ccrc;  // calculated crc
+	unsigned char *buf;
+	DWORD pos, n;
 
 	ccrc=update_crc(CRCINIT,(unsigned char*)m_chunktype_ascii,4);
-	ccrc=update_crc(ccrc,data,length);
+
+	if(m_data_deferred) {
+		// Read it a piece at a time, so we don't use too much memory.
+		buf=(unsigned char*)malloc(TWPNG_DEFERRED_BUFSIZE);
+		if(!buf) return m_crc;
+		for(pos=0;pos<length;pos+=n) {
+			n=length-pos;
+			if(n>TWPNG_DEFERRED_BUFSIZE) n=TWPNG_DEFERRED_BUFSIZE;
+			if(!get_data_segment(pos,buf,n)) {
+				// Can't check it; assume the one we have is right.
+				free(buf);
+				return m_crc;
+			}
+			ccrc=update_crc(ccrc,buf,n);
+		}
+		free(buf);
+	}
+	else {
+		ccrc=update_crc(ccrc,data,length);
+	}
 	ccrc=CRCCOMPL(ccrc);
 	return ccrc;
 }
 
+// Calculate the crcs of n chunks, like calc_crc(). The ones whose data is
+// in memory are done together, which is faster if they are small.
+void calc_chunk_crcs(Chunk **c, int n, DWORD *ccrc)
+{
+	unsigned char *bufs[TWPNG_CRC_BATCH];
+	DWORD lens[TWPNG_CRC_BATCH];
+	DWORD crcs[TWPNG_CRC_BATCH];
+	int idx[TWPNG_CRC_BATCH];
+	int i, j, count;
+
+	i=0;
+	while(i<n) {
+		count=0;
+		for(;i<n && count<TWPNG_CRC_BATCH;i++) {
+			if(c[i]->m_data_deferred) {
+				ccrc[i]=c[i]->calc_crc();
+				continue;
+			}
+			crcs[count]=update_crc(CRCINIT,(unsigned char*)c[i]->m_chunktype_ascii,4);
+			bufs[count]=c[i]->data;
+			lens[count]=c[i]->length;
+			idx[count]=i;
+			count++;
+		}
+		update_crc_multi(count,crcs,bufs,lens);
+		for(j=0;j<count;j++) {
+			ccrc[idx[j]]=CRCCOMPL(crcs[j]);
+		}
+	}
+}
+
+// The crc of just the chunk type, i.e. of a chunk with no data.
+static DWORD type_crc(const char *chunktype_ascii)
+{
+	return CRCCOMPL(update_crc(CRCINIT,(unsigned char*)chunktype_ascii,4));
+}
+
+// A chunk's crc covers the type followed by the data, so the crc of the
+// data alone can be worked out from it without reading the data. This is
+// used to build the crcs of combined or split chunks from the crcs of the
+// pieces.
+DWORD Chunk::get_data_crc()
+{
+	// If m_crc hasn't been checked, it might not belong to this data.
+	if(m_crc_unverified) verify_crc();
+	return m_crc ^ combine_crc(type_crc(m_chunktype_ascii),0,length);
+}
+
+// Use instead of chunkmodified() when the crc of the new data is known.
+void Chunk::set_data_crc(DWORD dcrc)
+{
+	m_crc=combine_crc(type_crc(m_chunktype_ascii),dcrc,length);
+	m_crc_unverified=0;
+}
+
+// Replace len bytes of the data, starting at offset, with buf, and update
+// the crc without reading the rest of the data.
+// A crc (without its initial and final inversion) is linear, so the change
+// in the crc is the crc of (old bytes XOR new bytes), followed by as many
+// zero bytes as there are after the changed part.
+// Like chunkmodified(), this doesn't call after_init() or Png::modified().
+// Returns 0 on failure.
+int Chunk::overwrite_data(DWORD offset, const unsigned char *buf, DWORD len)
+{
+	unsigned char tmpbuf[4096];
+	DWORD delta;
+	DWORD pos, n, i;
+
+	if(offset>length || len>length-offset) return 0;
+	if(len==0) return 1;
+	if(!make_data_private()) return 0;
+	if(m_crc_unverified) verify_crc();
+
+	delta=0;
+	for(pos=0;pos<len;pos+=n) {
+		n=len-pos;
+		if(n>sizeof(tmpbuf)) n=sizeof(tmpbuf);
+		for(i=0;i<n;i++) {
+			tmpbuf[i] = data[offset+pos+i] ^ buf[pos+i];
+		}
+		delta=update_crc(delta,tmpbuf,(int)n);
+	}
+	m_crc ^= combine_crc(delta,0,length-offset-len);
+
+	memcpy(&data[offset],buf,len);
+	return 1;
+}
+
 int Chunk::get_chunk_type_id()
 {
 	int i;
@@ -1310,13 +1559,19 @@ void Chunk::describe_fcTL(TCHAR *buf, int buflen)
 void Chunk::describe_fdAT(TCHAR *buf, int buflen)
 {
 	int seq;
+	unsigned char seqbuf[4];
 
 	if(length<4) {
 		msg_invalid_length(buf,buflen,_T("APNG frame data"));
 		return;
 	}
 
-	seq=read_int32(&data[0]);
+	// Don't read the whole chunk just to describe it.
+	if(!get_data_segment(0,seqbuf,4)) {
+		StringCchCopy(buf,buflen,_T("APNG frame data"));
+		return;
+	}
+	seq=read_int32(&seqbuf[0]);
 	StringCchPrintf(buf,buflen,_T("APNG frame data, seq#=%d"),seq);
 }
 
@@ -1448,7 +1703,7 @@ void Chunk::set_sCAL_data(const struct sCAL_data *d)
 	if(!x_latin1 || !y_latin1) goto done;
 
 	tot_len = 1 + xlen_latin1 + 1 + ylen_latin1;
-	if(data) { free(data); }
+	free_data();
 	length=0;
 	data = (unsigned char*)malloc(tot_len);
 	if(!data) return;
@@ -1500,7 +1755,7 @@ int Chunk::set_text_info(const TCHAR *keyword,
 	// It will be recreated by the get_text_info call at the end of this function.
 	free_text_info();
 
-	if(data) { free(data); data=NULL; } // lose the old data
+	free_data(); // lose the old data
 
 	if(is_international) {
 		ct=CHUNK_iTXt;
@@ -1929,6 +2184,9 @@ void Chunk::get_text_descr(TCHAR *buf, int buflen)
 	case CHUNK_fdAT: describe_fdAT(buf,buflen); break;
 	case CHUNK_CgBI: StringCchCopy(buf,buflen,_T("iPhone PNG-like file header")); break;
 	case CHUNK_vpAg: describe_vpAg(buf,buflen); break;
+	case CHUNK_twPd:
+		StringCchPrintf(buf,buflen,_T("padding, reserved for metadata to grow into (%u bytes)"),length);
+		break;
 
 	default:
 		if(!is_public()) {
@@ -2007,34 +2265,45 @@ void Chunk::describe_keyword_chunk(TCHAR *buf, int buflen, const TCHAR *prefix)
 }
 
 // if exp is nonzero, does not write the length or crc
-int Chunk::write_to_file(HANDLE fh, int exp)
+// The caller must flush w afterward.
+int Chunk::write_to_file(ChunkWriter *w, int exp)
 {
 	unsigned char buf[8];
-	DWORD written;
+	unsigned char *dbuf;
+	DWORD pos, n;
 
-	if(!exp) {
-		// write length
-		write_int32(&buf[0],length);
-		WriteFile(fh,(LPVOID)buf,4,&written,NULL);
-		if(written!=4) return 0;
+	// write length and type
+	write_int32(&buf[0],length);
+	memcpy(&buf[4],m_chunktype_ascii,4);
+	if(exp) {
+		if(!w->write(&buf[4],4)) return 0;
+	}
+	else {
+		if(!w->write(buf,8)) return 0;
 	}
-
-	// write type
-	memcpy(&buf[0],m_chunktype_ascii,4);
-	WriteFile(fh,(LPVOID)buf,4,&written,NULL);
-	if(written!=4) return 0;
 
 	// write data
-	if(length>0) {
-		WriteFile(fh,(LPVOID)data,length,&written,NULL);
-		if(written!=length) return 0;
+	if(m_data_deferred) {
+		// Copy it from the source file a piece at a time, instead of
+		// reading it all into memory.
+		dbuf=(unsigned char*)malloc(TWPNG_DEFERRED_BUFSIZE);
+		if(!dbuf) return 0;
+		for(pos=0;pos<length;pos+=n) {
+			n=length-pos;
+			if(n>TWPNG_DEFERRED_BUFSIZE) n=TWPNG_DEFERRED_BUFSIZE;
+			if(!get_data_segment(pos,dbuf,n)) { free(dbuf); return 0; }
+			if(!w->write(dbuf,n)) { free(dbuf); return 0; }
+		}
+		free(dbuf);
+	}
+	else if(length>0) {
+		if(!w->write(data,length)) return 0;
 	}
 
 	if(!exp) {
 		// write crc
 		write_int32(&buf[0],m_crc);
-		WriteFile(fh,(LPVOID)buf,4,&written,NULL);
-		if(written!=4) return 0;
+		if(!w->write(buf,4)) return 0;
 	}
 
 	return 1;
@@ -2043,48 +2312,65 @@ int Chunk::write_to_file(HANDLE fh, int exp)
 // Copy part or all of the chunk into a memory block.
 // This includes the length/type/crc.
 // Copies up to buflen bytes. Returns the number of bytes copied into buf.
+// The chunk is made of 3 pieces (length+type, data, crc), and each of them
+// that overlaps the requested range is copied with one memcpy.
 DWORD Chunk::copy_segment_to_memory(unsigned char *buf, DWORD offset, DWORD buflen)
 {
-	DWORD pos_in_buf;
-	DWORD pos_in_chunk;
-
-	for(pos_in_buf=0;pos_in_buf<buflen;pos_in_buf++) {
-		pos_in_chunk = offset+pos_in_buf;
-		if(pos_in_chunk>=length+12) {
-			return pos_in_buf; // reached end of chunk
-		}
-
-		if(pos_in_chunk<8) {
-			// writing the length or type
-			switch(pos_in_chunk) {
-			case 0: buf[pos_in_buf]= (unsigned char) ((length & 0xff000000)>>24); break;
-			case 1: buf[pos_in_buf]= (unsigned char) ((length & 0x00ff0000)>>16); break;
-			case 2: buf[pos_in_buf]= (unsigned char) ((length & 0x0000ff00)>> 8); break;
-			case 3: buf[pos_in_buf]= (unsigned char) ( length & 0x000000ff     ); break;
-			case 4: buf[pos_in_buf] = m_chunktype_ascii[0]; break;
-			case 5: buf[pos_in_buf] = m_chunktype_ascii[1]; break;
-			case 6: buf[pos_in_buf] = m_chunktype_ascii[2]; break;
-			case 7: buf[pos_in_buf] = m_chunktype_ascii[3]; break;
-			}
-		}
-		else if(pos_in_chunk >= (length+8)) {
-			// writing the crc
-			if(     pos_in_chunk==length+8 ) buf[pos_in_buf]= (unsigned char) ((m_crc & 0xff000000)>>24);
-			else if(pos_in_chunk==length+9 ) buf[pos_in_buf]= (unsigned char) ((m_crc & 0x00ff0000)>>16);
-			else if(pos_in_chunk==length+10) buf[pos_in_buf]= (unsigned char) ((m_crc & 0x0000ff00)>> 8); 
-			else if(pos_in_chunk==length+11) buf[pos_in_buf]= (unsigned char) ( m_crc & 0x000000ff     );
-		}
-		else {
-			// writing the data
-			buf[pos_in_buf] = data[pos_in_chunk-8];
-		}
+	unsigned char hdr[8];
+	unsigned char crcbuf[4];
+	DWORD total;
+	DWORD pos;  // position in chunk
+	DWORD n;
+
+	// Copying a little at a time from the file would be slow, so just read
+	// the whole thing.
+	if(m_data_deferred && !make_data_private()) return 0;
+
+	if(offset>=length+12) return 0; // reached end of chunk
+	if(buflen>length+12-offset) buflen=length+12-offset;
+	total=0;
+	pos=offset;
+
+	if(pos<8) {
+		// the length and type
+		write_int32(&hdr[0],length);
+		memcpy(&hdr[4],m_chunktype_ascii,4);
+		n=8-pos;
+		if(n>buflen) n=buflen;
+		memcpy(buf,&hdr[pos],n);
+		total+=n;
+		pos+=n;
+	}
+
+	if(total<buflen && pos<length+8) {
+		// the data
+		n=length+8-pos;
+		if(n>buflen-total) n=buflen-total;
+		memcpy(&buf[total],&data[pos-8],n);
+		total+=n;
+		pos+=n;
 	}
-	return pos_in_buf;
+
+	if(total<buflen) {
+		// the crc (buflen was limited to the end of the chunk)
+		write_int32(crcbuf,m_crc);
+		n=buflen-total;
+		memcpy(&buf[total],&crcbuf[pos-(length+8)],n);
+		total+=n;
+	}
+	return total;
 }
 
 Chunk::Chunk()
 {
 	data=NULL;
+	m_data_mapped=0;
+	m_crc_unverified=0;
+	m_data_deferred=0;
+	m_srcpos=0;
+	m_filepos=TWPNG_NO_FILEPOS;
+	m_filecrc=0;
+	m_file_stale=0;
 
 	m_text_info.processed=0;
 	m_text_info.is_compressed=0;
@@ -2096,7 +2382,7 @@ Chunk::Chunk()
 
 Chunk::~Chunk()
 {
-	if(data) free(data);
+	free_data();
 	free_text_info();
 }
 
@@ -2616,7 +2902,7 @@ INT_PTR CALLBACK Chunk::DlgProcEditChunk(HWND hwnd, UINT msg, WPARAM wParam, LPA
 		case CHUNK_fdAT:
 			SetWindowText(hwnd,_T("APNG frame data"));
 			SetDlgItemText(hwnd,IDC_LABEL1,_T("Sequence number"));
-			SetDlgItemInt(hwnd,IDC_EDIT1,read_int32(&ch->data[0]),FALSE);
+			SetDlgItemInt(hwnd,IDC_EDIT1,read_int32(&p->seqbuf[0]),FALSE);
 			break;
 
 		case CHUNK_oFFs:
@@ -2872,7 +3158,7 @@ INT_PTR CALLBACK Chunk::DlgProcEditChunk(HWND hwnd, UINT msg, WPARAM wParam, LPA
 
 			case CHUNK_fdAT:
 				tmpint1=GetDlgItemInt(hwnd,IDC_EDIT1,NULL,FALSE);
-				write_int32(&ch->data[0],tmpint1);
+				write_int32(&p->seqbuf[0],tmpint1);
 				break;
 
 			case CHUNK_oFFs:
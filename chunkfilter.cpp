@@ -0,0 +1,382 @@
+// chunkfilter.cpp
+//
+//
+/*
+    Copyright (C) 2012 Jason Summers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    See the file tweakpng-src.txt for more information.
+*/
+
+// Editing chunks without loading the file.
+//
+// ChunkFilter copies a PNG (or MNG or JNG) file from one stream to another,
+// one chunk at a time, leaving out, replacing, or inserting chunks
+// according to a list of rules. Image data chunks are copied a piece at a
+// time, so the memory used depends only on the size of the largest other
+// chunk, not on the size of the file. Every crc in the output is
+// recalculated, so damaged crcs are fixed on the way through.
+//
+// The rules can't remove or insert critical chunks, or touch the image
+// data. If the data of a critical chunk (e.g. PLTE) is replaced,
+// unrecognized ancillary chunks that aren't safe to copy are left out, as
+// the PNG spec requires.
+
+#include "twpng-config.h"
+
+#include <windows.h>
+#include <tchar.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "resource.h"
+#include "tweakpng.h"
+#include <strsafe.h>
+
+ChunkFilter::ChunkFilter()
+{
+	m_rules=NULL;
+	m_num_rules=0;
+	m_rules_alloc=0;
+	m_critical_changed=0;
+	m_num_chunks=0;
+	m_num_dropped=0;
+	m_num_crcs_fixed=0;
+}
+
+ChunkFilter::~ChunkFilter()
+{
+	int i;
+
+	for(i=0;i<m_num_rules;i++) {
+		if(m_rules[i].data) free(m_rules[i].data);
+	}
+	if(m_rules) free(m_rules);
+}
+
+// Leave out all chunks of this type.
+// Returns 0 on failure.
+int ChunkFilter::drop(const char *type)
+{
+	return add_rule(TWPNG_FILTER_DROP,type,NULL,NULL,0);
+}
+
+// Replace the data of all chunks of this type.
+// Returns 0 on failure.
+int ChunkFilter::replace(const char *type, const unsigned char *data, DWORD len)
+{
+	return add_rule(TWPNG_FILTER_REPLACE,type,NULL,data,len);
+}
+
+// Insert a new chunk of type newtype before the first chunk of this type.
+// Returns 0 on failure.
+int ChunkFilter::insert_before(const char *type, const char *newtype, const unsigned char *data, DWORD len)
+{
+	return add_rule(TWPNG_FILTER_INSERT,type,newtype,data,len);
+}
+
+// Replace any twPd (padding) chunks with one that has len bytes of data,
+// just before the image data (see Png::absorb_padding()). If len is 0, they
+// are just removed.
+// Returns 0 on failure.
+int ChunkFilter::set_padding(DWORD len)
+{
+	unsigned char *zeros;
+	int ret;
+
+	if(!drop("twPd")) return 0;
+	if(len==0) return 1;
+
+	zeros=(unsigned char*)calloc(len,1);
+	if(!zeros) return 0;
+	ret=insert_before("IDAT","twPd",zeros,len);
+	free(zeros);
+	return ret;
+}
+
+// Returns 1 if type is a valid chunk type.
+static int valid_chunk_type(const char *type)
+{
+	int i;
+
+	if(!type) return 0;
+	for(i=0;i<4;i++) {
+		if(!((type[i]>='a' && type[i]<='z') || (type[i]>='A' && type[i]<='Z')))
+			return 0;
+	}
+	return (type[4]=='\0');
+}
+
+int ChunkFilter::add_rule(int action, const char *type, const char *newtype,
+	const unsigned char *data, DWORD len)
+{
+	struct twpng_filter_rule *newrules;
+	struct twpng_filter_rule *rule;
+	Chunk *c;
+	int critical;
+	int id;
+
+	if(!valid_chunk_type(type) ||
+		(action==TWPNG_FILTER_INSERT && !valid_chunk_type(newtype)))
+	{
+		mesg(MSG_E,_T("Invalid chunk type"));
+		return 0;
+	}
+	if(len>TWPNG_MAX_CHUNK_LENGTH) {
+		mesg(MSG_E,_T("Chunk data too large"));
+		return 0;
+	}
+
+	// Use what Chunk knows about the type. An insert rule's type only says
+	// where the new chunk goes, so it's the new chunk that can't be critical.
+	c=new Chunk();
+	c->m_parentpng=NULL;
+	StringCchCopyA(c->m_chunktype_ascii,5,type);
+	id=c->get_chunk_type_id();
+	if(action==TWPNG_FILTER_INSERT)
+		StringCchCopyA(c->m_chunktype_ascii,5,newtype);
+	critical=c->is_critical();
+	delete c;
+
+	if(action!=TWPNG_FILTER_INSERT &&
+		(id==CHUNK_IDAT || id==CHUNK_JDAT || id==CHUNK_fdAT))
+	{
+		mesg(MSG_E,_T("Image data chunks can") SYM_RSQUO _T("t be removed or replaced"));
+		return 0;
+	}
+	if(critical && action!=TWPNG_FILTER_REPLACE) {
+		mesg(MSG_E,_T("Critical chunks can") SYM_RSQUO _T("t be removed or inserted"));
+		return 0;
+	}
+
+	if(m_num_rules>=m_rules_alloc) {
+		newrules=(struct twpng_filter_rule*)realloc((void*)m_rules,
+			(m_rules_alloc+16)*sizeof(struct twpng_filter_rule));
+		if(!newrules) return 0;
+		m_rules=newrules;
+		m_rules_alloc+=16;
+	}
+
+	rule=&m_rules[m_num_rules];
+	ZeroMemory((void*)rule,sizeof(struct twpng_filter_rule));
+	rule->action=action;
+	StringCchCopyA(rule->type,5,type);
+	if(newtype) StringCchCopyA(rule->newtype,5,newtype);
+	if(len>0) {
+		rule->data=(unsigned char*)malloc(len);
+		if(!rule->data) return 0;
+		memcpy(rule->data,data,len);
+	}
+	rule->len=len;
+	m_num_rules++;
+
+	if(critical && action==TWPNG_FILTER_REPLACE) m_critical_changed=1;
+	return 1;
+}
+
+// Returns the first rule with this action for this chunk type, or NULL.
+struct twpng_filter_rule *ChunkFilter::find_rule(int action, const char *type)
+{
+	int i;
+
+	for(i=0;i<m_num_rules;i++) {
+		if(m_rules[i].action==action && !strcmp(m_rules[i].type,type))
+			return &m_rules[i];
+	}
+	return NULL;
+}
+
+static DWORD calc_chunk_crc(const char *type, const unsigned char *data, DWORD len)
+{
+	DWORD crc;
+
+	crc=update_crc(CRCINIT,(unsigned char*)type,4);
+	if(len>0) crc=update_crc(crc,(unsigned char*)data,(int)len);
+	return CRCCOMPL(crc);
+}
+
+int ChunkFilter::write_chunk(ChunkWriter *w, const char *type, const unsigned char *data,
+	DWORD len, DWORD crc)
+{
+	unsigned char buf[8];
+
+	write_int32(&buf[0],len);
+	memcpy(&buf[4],type,4);
+	if(!w->write(buf,8)) return 0;
+	if(len>0 && !w->write(data,len)) return 0;
+	write_int32(&buf[0],crc);
+	return w->write(buf,4);
+}
+
+// Copy the data and crc of an image data chunk whose length and type
+// next_chunk() has read, a piece at a time.
+int ChunkFilter::copy_image_data(ChunkParser *p, ChunkWriter *w, Chunk *c)
+{
+	unsigned char *buf;
+	unsigned char hdr[8];
+	DWORD ccrc;
+	DWORD pos, n;
+	int ret=1;
+
+	buf=(unsigned char*)malloc(TWPNG_DEFERRED_BUFSIZE);
+	if(!buf) {
+		mesg(MSG_S,_T("Can") SYM_RSQUO _T("t allocate memory"));
+		return 0;
+	}
+
+	write_int32(&hdr[0],c->length);
+	memcpy(&hdr[4],c->m_chunktype_ascii,4);
+	ret=w->write(hdr,8);
+
+	ccrc=update_crc(CRCINIT,(unsigned char*)c->m_chunktype_ascii,4);
+	for(pos=0;ret && pos<c->length;pos+=n) {
+		n=c->length-pos;
+		if(n>TWPNG_DEFERRED_BUFSIZE) n=TWPNG_DEFERRED_BUFSIZE;
+		if(p->read_data(buf,n,&ccrc)!=(int)n) {
+			mesg(MSG_E,_T("Error reading file, or file is truncated"));
+			ret=0;
+		}
+		else {
+			ret=w->write(buf,n);
+		}
+	}
+	free(buf);
+	if(!ret) return 0;
+
+	if(p->read_data(hdr,4,NULL)!=4) {
+		mesg(MSG_E,_T("Error reading file, or file is truncated"));
+		return 0;
+	}
+	ccrc=CRCCOMPL(ccrc);
+	if(read_int32(hdr)!=ccrc) m_num_crcs_fixed++;
+	write_int32(&hdr[0],ccrc);
+	return w->write(hdr,4);
+}
+
+// Copy the file from read_fn to outfh, applying the rules.
+// Returns 1 on success, 0 on failure (in which case the output is
+// incomplete).
+int ChunkFilter::run(twpng_read_cb_type read_fn, void *userdata, HANDLE outfh)
+{
+	ChunkParser *parser;
+	ChunkWriter *w;
+	Chunk *c;
+	struct twpng_filter_rule *rule;
+	unsigned char sig[8];
+	TCHAR type_tchar[5], newtype_tchar[5];
+	DWORD ccrc;
+	int ret;
+	int r;
+	int i;
+
+	m_num_chunks=0;
+	m_num_dropped=0;
+	m_num_crcs_fixed=0;
+	for(i=0;i<m_num_rules;i++) m_rules[i].count=0;
+
+	parser=new ChunkParser(read_fn,userdata);
+	w=new ChunkWriter(outfh);
+
+	ret=parser->read_signature(sig);
+	if(!ret) {
+		mesg(MSG_E,_T("Unrecognized file format"));
+	}
+	else {
+		ret=w->write(sig,8);
+	}
+
+	while(ret) {
+		c=new Chunk();
+		c->m_parentpng=NULL;
+		r=parser->next_chunk(c,TWPNG_PF_NOCRC|TWPNG_PF_STREAMIMAGE,&ccrc);
+		if(r==TWPNG_PARSE_END) {
+			delete c;
+			break;
+		}
+		if(r!=TWPNG_PARSE_CHUNK && r!=TWPNG_PARSE_STREAM) {
+			delete c;
+			if(r==TWPNG_PARSE_NOMEM)
+				mesg(MSG_S,_T("Can") SYM_RSQUO _T("t allocate memory for chunk"));
+			else
+				mesg(MSG_E,_T("Invalid chunk found at file position %I64u"),parser->m_chunkpos);
+			ret=0;
+			break;
+		}
+		m_num_chunks++;
+
+		// New chunks go before the first chunk of the rule's type.
+		for(i=0;ret && i<m_num_rules;i++) {
+			rule=&m_rules[i];
+			if(rule->action!=TWPNG_FILTER_INSERT || rule->count>0) continue;
+			if(strcmp(rule->type,c->m_chunktype_ascii)) continue;
+			ret=write_chunk(w,rule->newtype,rule->data,rule->len,
+				calc_chunk_crc(rule->newtype,rule->data,rule->len));
+			rule->count++;
+		}
+		if(!ret) {
+			delete c;
+			break;
+		}
+
+		// (The rules never apply to image data chunks.)
+		if(r==TWPNG_PARSE_STREAM) {
+			ret=copy_image_data(parser,w,c);
+		}
+		else if((rule=find_rule(TWPNG_FILTER_DROP,c->m_chunktype_ascii))) {
+			rule->count++;
+			m_num_dropped++;
+		}
+		else if(m_critical_changed && !c->is_critical() && !c->is_safe_to_copy() &&
+			c->get_chunk_type_id()==CHUNK_UNKNOWN)
+		{
+			// It may depend on the critical chunk we changed, and we can't
+			// tell how.
+			m_num_dropped++;
+		}
+		else if((rule=find_rule(TWPNG_FILTER_REPLACE,c->m_chunktype_ascii))) {
+			rule->count++;
+			ret=write_chunk(w,c->m_chunktype_ascii,rule->data,rule->len,
+				calc_chunk_crc(c->m_chunktype_ascii,rule->data,rule->len));
+		}
+		else {
+			ccrc=calc_chunk_crc(c->m_chunktype_ascii,c->data,c->length);
+			if(ccrc!=c->m_crc) m_num_crcs_fixed++;
+			ret=write_chunk(w,c->m_chunktype_ascii,c->data,c->length,ccrc);
+		}
+		delete c;
+	}
+
+	if(ret) ret=w->flush();
+	if(!ret && w->m_failed) {
+		mesg(MSG_E,_T("Error writing file"));
+	}
+	delete w;
+	delete parser;
+
+	if(ret) {
+		for(i=0;i<m_num_rules;i++) {
+			rule=&m_rules[i];
+			if(rule->action==TWPNG_FILTER_INSERT && rule->count==0) {
+				for(r=0;r<=4;r++) {
+					type_tchar[r]=(TCHAR)rule->type[r];
+					newtype_tchar[r]=(TCHAR)rule->newtype[r];
+				}
+				mesg(MSG_W,_T("There was no %s chunk, so the %s chunk was not inserted."),
+					type_tchar,newtype_tchar);
+			}
+		}
+	}
+	return ret;
+}
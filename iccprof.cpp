@@ -641,7 +641,7 @@ void Chunk::process_iCCP_dlg(struct edit_chunk_ctx *ecctx, HWND hwnd)
 	memcpy(&new_data[0],new_name_latin1,new_name_latin1_len);
 	// NUL separator and remaining data
 	memcpy(&new_data[new_name_latin1_len],&data[kw.keyword_len],length_excluding_name);
-	free(data);
+	free_data();
 	data = new_data;
 	length = new_chunk_len;
 	new_data = NULL;
@@ -0,0 +1,601 @@
+// iotest.cpp
+//
+//
+/*
+    Copyright (C) 2012 Jason Summers
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    See the file tweakpng-src.txt for more information.
+*/
+
+// Test files for the loading and saving code, run from the command line
+// (see _tWinMain()).
+//
+// "-mkbig" writes PNG files bigger than 4GB, which is where 32-bit sizes
+// and offsets would go wrong. Most of the file is image data that is all
+// zeros, and is skipped over instead of being written, so the file is
+// made in about a second, and on NTFS takes almost no disk space.
+//
+// "-iotest" measures how fast files are read, and how many reads it takes,
+// writing one tab-separated line per test to a file, like "-crctest". It
+// also measures how fast a big chunk is copied out of memory, the way the
+// clipboard and the viewer do it.
+
+#include "twpng-config.h"
+
+#include <windows.h>
+#include <tchar.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "resource.h"
+#include "tweakpng.h"
+#include <strsafe.h>
+
+// Largest IDAT chunk in a file made by twpng_make_big_png()
+#define MKBIG_IDAT_MAX  0x40000000
+
+// The file io_selftest() reads has this many IDAT chunks of this size, like
+// an APNG file with many small frames.
+#define IOTEST_CHUNKS     100000
+#define IOTEST_CHUNK_LEN  100
+
+// The image io_selftest() streams from memory has one IDAT chunk of this
+// many zero bytes, which is copied IOTEST_STREAM_BUFSIZE bytes at a time
+// (the size libpng reads are about, in the viewer).
+#define IOTEST_STREAM_LEN      (500*1024*1024)
+#define IOTEST_STREAM_BUFSIZE  65536
+
+// Where the big IDAT chunk starts in that file: after the signature, IHDR,
+// and the IDAT chunk with the real image data.
+#define IOTEST_STREAM_CHUNKPOS  (8+(12+13)+(12+10))
+
+static const unsigned char mkbig_sig[8] = {137,80,78,71,13,10,26,10};
+
+// A 1x1 8-bit grayscale image: the IHDR data, and a zlib stream of its one
+// row (filter type 0, pixel value 0). The zeros that follow it in the
+// other IDAT chunks are extra data, which decoders ignore or warn about.
+static const unsigned char mkbig_ihdr[13] = {0,0,0,1, 0,0,0,1, 8,0,0,0,0};
+static const unsigned char mkbig_idat[10] = {0x78,0xda,0x63,0x60,0x00,0x00,0x00,0x02,0x00,0x01};
+
+// The crc of n zero bytes, put together from the crcs of 1, 2, 4, ... zero
+// bytes, so it doesn't take time in proportion to n.
+static DWORD zeros_crc(ULONGLONG n)
+{
+	unsigned char zero=0;
+	ULONGLONG powlen;
+	DWORD pow;  // crc of powlen zero bytes
+	DWORD crc;
+
+	crc=0;  // the crc of nothing
+	powlen=1;
+	pow=CRCCOMPL(update_crc(CRCINIT,&zero,1));
+	while(n) {
+		if(n & 1) crc=combine_crc(crc,pow,powlen);
+		pow=combine_crc(pow,pow,powlen);
+		powlen<<=1;
+		n>>=1;
+	}
+	return crc;
+}
+
+// The crc of an IDAT chunk of len zero bytes.
+static DWORD idat_zeros_crc(DWORD len)
+{
+	DWORD crc;
+
+	crc=CRCCOMPL(update_crc(CRCINIT,(unsigned char*)"IDAT",4));
+	return combine_crc(crc,zeros_crc(len),len);
+}
+
+static int mkbig_write_chunk(ChunkWriter *w, const char *type,
+	const unsigned char *data, DWORD len)
+{
+	unsigned char buf[8];
+	DWORD crc;
+
+	write_int32(&buf[0],len);
+	memcpy(&buf[4],type,4);
+	if(!w->write(buf,8)) return 0;
+	if(len>0 && !w->write(data,len)) return 0;
+	crc=update_crc(CRCINIT,(unsigned char*)type,4);
+	if(len>0) crc=update_crc(crc,(unsigned char*)data,(int)len);
+	write_int32(&buf[0],CRCCOMPL(crc));
+	return w->write(buf,4);
+}
+
+// Write an IDAT chunk of len zero bytes at *pos, without writing the data,
+// and move *pos past it.
+static int mkbig_write_zeros(ChunkWriter *w, ULONGLONG *pos, DWORD len)
+{
+	unsigned char buf[8];
+	DWORD crc;
+
+	write_int32(&buf[0],len);
+	memcpy(&buf[4],"IDAT",4);
+	if(!w->write(buf,8)) return 0;
+	*pos += 8+(ULONGLONG)len;
+	if(!w->seek(*pos)) return 0;
+
+	write_int32(&buf[0],idat_zeros_crc(len));
+	*pos += 4;
+	return w->write(buf,4);
+}
+
+// Write a PNG file of (about) size bytes, whose image data is mostly in
+// IDAT chunks of up to 1GB of zeros. The file is made sparse if the file
+// system supports it; if not, the system writes the zeros.
+// Returns 1 on success.
+int twpng_make_big_png(const TCHAR *fn, ULONGLONG size)
+{
+	HANDLE fh;
+	ChunkWriter *w;
+	ULONGLONG pos;
+	ULONGLONG left;
+	DWORD len;
+	DWORD n;
+	int ret;
+
+	fh=CreateFile(fn,GENERIC_WRITE,0,NULL,CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,NULL);
+	if(fh==INVALID_HANDLE_VALUE) return 0;
+	DeviceIoControl(fh,FSCTL_SET_SPARSE,NULL,0,NULL,0,&n,NULL);
+
+	w=new ChunkWriter(fh);
+	ret = w->write(mkbig_sig,8) &&
+		mkbig_write_chunk(w,"IHDR",mkbig_ihdr,13) &&
+		mkbig_write_chunk(w,"IDAT",mkbig_idat,10);
+	pos = 8 + (12+13) + (12+10);
+
+	// Leave room for IEND, and the length, type and crc of each IDAT.
+	while(ret && pos+12+12 < size) {
+		left = size-pos-12-12;
+		len = (left>MKBIG_IDAT_MAX) ? MKBIG_IDAT_MAX : (DWORD)left;
+		ret = mkbig_write_zeros(w,&pos,len);
+	}
+
+	if(ret) ret = mkbig_write_chunk(w,"IEND",NULL,0) && w->flush();
+	delete w;
+	if(ret) ret = FlushFileBuffers(fh) ? 1 : 0;
+	CloseHandle(fh);
+	if(!ret) DeleteFile(fn);
+	return ret;
+}
+
+// A file that counts how many times it's read.
+struct iotest_source {
+	HANDLE fh;
+	DWORD reads;
+};
+
+static int iotest_read_fn(void *userdata, unsigned char *buf, DWORD nbytes)
+{
+	struct iotest_source *src = (struct iotest_source*)userdata;
+
+	src->reads++;
+	return twpng_file_read_fn((void*)src->fh,buf,nbytes);
+}
+
+static void iotest_printf(HANDLE fh, const char *fmt, ...)
+{
+	char buf[500];
+	DWORD written;
+	va_list ap;
+
+	va_start(ap,fmt);
+	StringCchVPrintfA(buf,500,fmt,ap);
+	va_end(ap);
+	WriteFile(fh,(LPVOID)buf,(DWORD)lstrlenA(buf),&written,NULL);
+}
+
+// Write the IDAT test file. Returns 1 on success.
+static int iotest_make_file(const TCHAR *fn)
+{
+	unsigned char data[IOTEST_CHUNK_LEN];
+	HANDLE fh;
+	ChunkWriter *w;
+	int ret;
+	int i;
+
+	fh=CreateFile(fn,GENERIC_WRITE,0,NULL,CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,NULL);
+	if(fh==INVALID_HANDLE_VALUE) return 0;
+
+	ZeroMemory((void*)data,IOTEST_CHUNK_LEN);
+	w=new ChunkWriter(fh);
+	ret = w->write(mkbig_sig,8) && mkbig_write_chunk(w,"IHDR",mkbig_ihdr,13);
+	for(i=0;ret && i<IOTEST_CHUNKS;i++) {
+		ret = mkbig_write_chunk(w,"IDAT",data,IOTEST_CHUNK_LEN);
+	}
+	if(ret) ret = mkbig_write_chunk(w,"IEND",NULL,0) && w->flush();
+	delete w;
+	CloseHandle(fh);
+	return ret;
+}
+
+// Read the chunks the way TweakPNG did before ChunkParser: one ReadFile
+// for the length and type, one for the data, and one for the crc.
+// Returns the number of chunks whose crcs were right.
+static int iotest_read_triple(struct iotest_source *src)
+{
+	unsigned char fbuf[8];
+	unsigned char *data;
+	DWORD n, len, crc;
+	int nchunks=0;
+
+	src->reads++;
+	if(!ReadFile(src->fh,(LPVOID)fbuf,8,&n,NULL) || n!=8) return 0;
+
+	for(;;) {
+		src->reads++;
+		if(!ReadFile(src->fh,(LPVOID)fbuf,8,&n,NULL) || n!=8) break;
+		len=read_int32(&fbuf[0]);
+		if(len>TWPNG_MAX_CHUNK_LENGTH) break;
+
+		data=NULL;
+		if(len>0) {
+			data=(unsigned char*)malloc(len);
+			if(!data) break;
+		}
+		src->reads++;
+		if(!ReadFile(src->fh,(LPVOID)data,len,&n,NULL) || n!=len) {
+			if(data) free(data);
+			break;
+		}
+		crc=update_crc(CRCINIT,&fbuf[4],4);
+		if(len>0) crc=update_crc(crc,data,(int)len);
+		if(data) free(data);
+
+		src->reads++;
+		if(!ReadFile(src->fh,(LPVOID)fbuf,4,&n,NULL) || n!=4) break;
+		if(read_int32(&fbuf[0])==CRCCOMPL(crc)) nchunks++;
+	}
+	return nchunks;
+}
+
+// Read the chunks with ChunkParser, the way ChunkFilter does.
+// Returns the number of chunks whose crcs were right.
+static int iotest_read_parser(struct iotest_source *src)
+{
+	unsigned char sig[8];
+	ChunkParser *parser;
+	Chunk *c;
+	DWORD ccrc;
+	int nchunks=0;
+
+	parser=new ChunkParser(iotest_read_fn,(void*)src);
+	if(parser->read_signature(sig)) {
+		for(;;) {
+			c=new Chunk();
+			c->m_parentpng=NULL;
+			if(parser->next_chunk(c,0,&ccrc)!=TWPNG_PARSE_CHUNK) {
+				delete c;
+				break;
+			}
+			if(c->m_crc==ccrc) nchunks++;
+			delete c;
+		}
+	}
+	delete parser;
+	return nchunks;
+}
+
+// Load the file into a Png, the way opening it does.
+// Returns the number of chunks, or 0 if there were any messages.
+static int iotest_read_png(struct iotest_source *src)
+{
+	struct twpng_quiet_state qs;
+	TCHAR buf[256];
+	Png *png;
+	int nchunks;
+
+	twpng_push_quiet_mesg(&qs);
+	png=new Png(iotest_read_fn,(void*)src);
+	nchunks = png->m_valid ? png->m_num_chunks : 0;
+	if(twpng_get_quiet_mesg(buf,256)) nchunks=0;
+	delete png;
+	twpng_pop_quiet_mesg(&qs);
+	return nchunks;
+}
+
+enum { IOT_TRIPLE, IOT_PARSER, IOT_PNG, IOT_NUM_READERS };
+
+static const char *iotest_reader_name[IOT_NUM_READERS] = {
+	"triple", "parser", "load"
+};
+
+// Read the test file one way, and write its line.
+// Returns 1 if all the chunks were read, with the right crcs.
+static int iotest_read_test(HANDLE outfh, const TCHAR *fn, int reader,
+	const LARGE_INTEGER *freq)
+{
+	struct iotest_source src;
+	LARGE_INTEGER t0, t1;
+	LARGE_INTEGER size;
+	double secs;
+	int nchunks;
+	int ok;
+
+	src.fh=CreateFile(fn,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,NULL);
+	if(src.fh==INVALID_HANDLE_VALUE) return 0;
+	if(!GetFileSizeEx(src.fh,&size)) size.QuadPart=0;
+	src.reads=0;
+
+	QueryPerformanceCounter(&t0);
+	switch(reader) {
+	case IOT_TRIPLE: nchunks=iotest_read_triple(&src); break;
+	case IOT_PARSER: nchunks=iotest_read_parser(&src); break;
+	default:         nchunks=iotest_read_png(&src);
+	}
+	QueryPerformanceCounter(&t1);
+	CloseHandle(src.fh);
+	secs = (double)(t1.QuadPart-t0.QuadPart)/(double)freq->QuadPart;
+
+	ok = (nchunks==IOTEST_CHUNKS+2);
+	iotest_printf(outfh,"%s\t%d\t%I64u\t%u\t%.6f\t%.1f\t%s\n",
+		iotest_reader_name[reader],nchunks,(ULONGLONG)size.QuadPart,
+		src.reads,secs,secs>0.0 ? (double)size.QuadPart/secs/1.0e6 : 0.0,
+		ok?"ok":"FAIL");
+	return ok;
+}
+
+// A PNG file that is made up as it's read, with a big IDAT chunk of zeros
+// (like the ones from twpng_make_big_png()), so that it doesn't need a file
+// on disk.
+struct iotest_stream_source {
+	unsigned char hdr[IOTEST_STREAM_CHUNKPOS+8]; // up to the big chunk's data
+	unsigned char tail[4+12];  // its crc, and IEND
+	ULONGLONG size;
+	ULONGLONG pos;  // used by iotest_stream_read_fn
+	DWORD reads;
+};
+
+// Write a chunk into memory. Returns its size.
+static DWORD iotest_put_chunk(unsigned char *p, const char *type,
+	const unsigned char *data, DWORD len)
+{
+	DWORD crc;
+
+	write_int32(&p[0],len);
+	memcpy(&p[4],type,4);
+	if(len>0) memcpy(&p[8],data,len);
+	crc=update_crc(CRCINIT,&p[4],4+(int)len);
+	write_int32(&p[8+len],CRCCOMPL(crc));
+	return 12+len;
+}
+
+static void iotest_stream_init(struct iotest_stream_source *src)
+{
+	unsigned char *p;
+
+	p=src->hdr;
+	memcpy(p,mkbig_sig,8);
+	p+=8;
+	p+=iotest_put_chunk(p,"IHDR",mkbig_ihdr,13);
+	p+=iotest_put_chunk(p,"IDAT",mkbig_idat,10);
+	write_int32(&p[0],IOTEST_STREAM_LEN);
+	memcpy(&p[4],"IDAT",4);
+
+	write_int32(&src->tail[0],idat_zeros_crc(IOTEST_STREAM_LEN));
+	iotest_put_chunk(&src->tail[4],"IEND",NULL,0);
+
+	src->size=sizeof(src->hdr)+(ULONGLONG)IOTEST_STREAM_LEN+sizeof(src->tail);
+	src->pos=0;
+	src->reads=0;
+}
+
+// Copy len bytes of the made-up file, from position pos.
+// pos+len must not be past the end of it.
+static void iotest_stream_bytes(const struct iotest_stream_source *src,
+	ULONGLONG pos, unsigned char *buf, DWORD len)
+{
+	const ULONGLONG dataend = sizeof(src->hdr)+(ULONGLONG)IOTEST_STREAM_LEN;
+	DWORD n;
+
+	while(len>0) {
+		if(pos<sizeof(src->hdr)) {
+			n=(DWORD)(sizeof(src->hdr)-pos);
+			if(n>len) n=len;
+			memcpy(buf,&src->hdr[pos],n);
+		}
+		else if(pos<dataend) {
+			n = (dataend-pos>len) ? len : (DWORD)(dataend-pos);
+			ZeroMemory((void*)buf,n);
+		}
+		else {
+			n=len;
+			memcpy(buf,&src->tail[pos-dataend],n);
+		}
+		buf+=n;
+		pos+=n;
+		len-=n;
+	}
+}
+
+static int iotest_stream_read_fn(void *userdata, unsigned char *buf, DWORD nbytes)
+{
+	struct iotest_stream_source *src = (struct iotest_stream_source*)userdata;
+
+	if(nbytes>src->size-src->pos) nbytes=(DWORD)(src->size-src->pos);
+	iotest_stream_bytes(src,src->pos,buf,nbytes);
+	src->pos+=nbytes;
+	return (int)nbytes;
+}
+
+enum { IOT_MEMCPY, IOT_SEGMENT, IOT_STREAM, IOT_NUM_COPIERS };
+
+static const char *iotest_copier_name[IOT_NUM_COPIERS] = {
+	"memcpy", "segment", "stream"
+};
+
+// Copy the big chunk (or the whole file) out of png one way, a piece at a
+// time. If check is set, compare each piece with what it should be.
+// Returns the number of bytes copied, or 0 if a piece was wrong.
+static ULONGLONG iotest_copy(Png *png, const struct iotest_stream_source *src,
+	int copier, unsigned char *buf, unsigned char *checkbuf, int check,
+	DWORD *pieces)
+{
+	Chunk *c;
+	ULONGLONG pos;  // position in the file
+	ULONGLONG total=0;
+	DWORD n;
+
+	c=png->chunk[2];
+	if(copier==IOT_STREAM) png->stream_file_start();
+	pos = (copier==IOT_STREAM) ? 0 : IOTEST_STREAM_CHUNKPOS;
+	if(copier==IOT_MEMCPY) pos+=8;
+
+	for(;;) {
+		switch(copier) {
+		case IOT_MEMCPY:
+			n=IOTEST_STREAM_BUFSIZE;
+			if(n>c->length-(DWORD)total) n=c->length-(DWORD)total;
+			memcpy(buf,&c->data[total],n);
+			break;
+		case IOT_SEGMENT:
+			n=c->copy_segment_to_memory(buf,(DWORD)total,IOTEST_STREAM_BUFSIZE);
+			break;
+		default:
+			n=png->stream_file_read(buf,IOTEST_STREAM_BUFSIZE);
+		}
+		if(n==0) break;
+		(*pieces)++;
+		if(check) {
+			iotest_stream_bytes(src,pos,checkbuf,n);
+			if(memcmp(buf,checkbuf,n)) {
+				total=0;
+				break;
+			}
+		}
+		total+=n;
+		pos+=n;
+	}
+
+	if(copier==IOT_STREAM) png->stream_file_end();
+	return total;
+}
+
+// Time copying the big chunk one way, check it, and write its line.
+// Returns 1 if the right bytes were copied.
+static int iotest_copy_test(HANDLE outfh, Png *png,
+	const struct iotest_stream_source *src, int copier,
+	unsigned char *buf, unsigned char *checkbuf, const LARGE_INTEGER *freq)
+{
+	LARGE_INTEGER t0, t1;
+	ULONGLONG total, expected;
+	DWORD pieces=0;
+	DWORD checkpieces=0;
+	double secs;
+	int ok;
+
+	QueryPerformanceCounter(&t0);
+	total=iotest_copy(png,src,copier,buf,checkbuf,0,&pieces);
+	QueryPerformanceCounter(&t1);
+	secs = (double)(t1.QuadPart-t0.QuadPart)/(double)freq->QuadPart;
+
+	switch(copier) {
+	case IOT_MEMCPY:  expected=IOTEST_STREAM_LEN; break;
+	case IOT_SEGMENT: expected=IOTEST_STREAM_LEN+12; break;
+	default:          expected=src->size;
+	}
+
+	// Checking is done separately, so that it isn't part of the time.
+	ok = (total==expected) &&
+		(iotest_copy(png,src,copier,buf,checkbuf,1,&checkpieces)==expected);
+	iotest_printf(outfh,"%s\t%d\t%I64u\t%u\t%.6f\t%.1f\t%s\n",
+		iotest_copier_name[copier],(copier==IOT_STREAM)?png->m_num_chunks:1,
+		total,pieces,secs,secs>0.0 ? (double)total/secs/1.0e6 : 0.0,
+		ok?"ok":"FAIL");
+	return ok;
+}
+
+// Make a Png with a big IDAT chunk in memory, and time copying it out.
+// Returns 0 if it couldn't be made, or any test failed.
+static int iotest_copy_tests(HANDLE outfh, const LARGE_INTEGER *freq)
+{
+	struct iotest_stream_source src;
+	struct twpng_quiet_state qs;
+	TCHAR mbuf[256];
+	unsigned char *buf;
+	unsigned char *checkbuf;
+	Png *png;
+	int ok;
+	int i;
+
+	buf=(unsigned char*)malloc(IOTEST_STREAM_BUFSIZE);
+	checkbuf=(unsigned char*)malloc(IOTEST_STREAM_BUFSIZE);
+	if(!buf || !checkbuf) {
+		if(buf) free(buf);
+		if(checkbuf) free(checkbuf);
+		return 0;
+	}
+
+	iotest_stream_init(&src);
+	twpng_push_quiet_mesg(&qs);
+	png=new Png(iotest_stream_read_fn,(void*)&src);
+	ok = png->m_valid && png->m_num_chunks==4 &&
+		png->chunk[2]->length==IOTEST_STREAM_LEN &&
+		!twpng_get_quiet_mesg(mbuf,256);
+	twpng_pop_quiet_mesg(&qs);
+
+	for(i=0;ok && i<IOT_NUM_COPIERS;i++) {
+		if(!iotest_copy_test(outfh,png,&src,i,buf,checkbuf,freq)) ok=0;
+	}
+
+	delete png;
+	free(checkbuf);
+	free(buf);
+	return ok;
+}
+
+// Self-test and benchmark, run by "tweakpng -iotest [file]".
+// Returns the process exit code: 0 if all the tests passed, 1 if any
+// failed, or 2 if they couldn't be run.
+int io_selftest(const TCHAR *fn)
+{
+	TCHAR dir[MAX_PATH];
+	TCHAR tmpfn[MAX_PATH];
+	LARGE_INTEGER freq;
+	HANDLE fh;
+	int failed;
+	int i;
+
+	if(!GetTempPath(MAX_PATH,dir)) return 2;
+	if(!GetTempFileName(dir,_T("twp"),0,tmpfn)) return 2;
+	if(!iotest_make_file(tmpfn)) {
+		DeleteFile(tmpfn);
+		return 2;
+	}
+
+	fh=CreateFile(fn,GENERIC_WRITE,0,NULL,CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,NULL);
+	if(fh==INVALID_HANDLE_VALUE) {
+		DeleteFile(tmpfn);
+		return 2;
+	}
+
+	QueryPerformanceFrequency(&freq);
+	failed=0;
+
+	// The file was just written, so it should all be in the system's
+	// cache, and the times are mostly the cost of the reads themselves.
+	iotest_printf(fh,"impl\tchunks\tbytes\treads\tseconds\tmbps\tresult\n");
+	for(i=0;i<IOT_NUM_READERS;i++) {
+		if(!iotest_read_test(fh,tmpfn,i,&freq)) failed=1;
+	}
+	if(!iotest_copy_tests(fh,&freq)) failed=1;
+
+	CloseHandle(fh);
+	DeleteFile(tmpfn);
+	return failed;
+}
@@ -147,6 +147,12 @@
 #define ID_NEWVPAG                      40068
 #define ID_COPYIMAGE                    40069
 #define ID_CORRECTNONSQUARE             40070
+#define ID_MAPFILES                     40071
+#define ID_LAZYLOAD                     40072
+#define ID_OPENRECOVER                  40073
+#define ID_WATCHFILE                    40074
+#define ID_REPAIRCRC                    40075
+#define ID_NEWTWPD                      40076
 
 // Next default values for new objects
 // 
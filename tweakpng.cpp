@@ -47,6 +47,9 @@
 #include <malloc.h>
 #include <stdarg.h>
 #include <commctrl.h>
+#ifdef TWPNG_USE_SSE2
+#include <emmintrin.h>
+#endif
 
 #include "resource.h"
 #include "tweakpng.h"
@@ -58,6 +61,14 @@
 #include <strsafe.h>
 
 #define UPDATE_DELAY 400  // milliseconds
+#define WATCH_DELAY  500  // milliseconds to wait for a changed file to settle down
+
+// Timer IDs for the main window
+#define TWPNG_TIMER_VIEWER  1
+#define TWPNG_TIMER_WATCH   2
+
+// Posted to the main window by the file watcher thread
+#define WM_TWPNG_FILECHANGED (WM_APP+1)
 
 static Png *png;
 Viewer *g_viewer;
@@ -73,37 +84,61 @@ static INT_PTR CALLBACK DlgProcTools(HWND hWnd, UINT msg, WPARAM wParam, LPARAM
 
 static int OkToClosePNG();
 static void SetTitle(Png *p);
+static void StartWatching();
+static void StopWatching();
 static void ImportChunkByFilename(const TCHAR *fn, int pos);
 static int GetLVFocus(HWND hwnd);
-
-/* make the table for a fast crc */
-void make_crc_table()
+static int get_file_stamp(const TCHAR *fn, ULONGLONG *psize, FILETIME *ptime);
+static int read_file_at(HANDLE fh, ULONGLONG pos, unsigned char *buf, DWORD len);
+
+// Threads that load files in the background (see batch.cpp) can't show
+// message boxes, so they turn on "quiet" mode. Messages are then counted,
+// and the first one is saved.
+static __declspec(thread) int quiet_mesg;
+static __declspec(thread) int quiet_mesg_count;
+static __declspec(thread) TCHAR quiet_mesg_buf[256];
+
+// Returns the previous setting. The message count isn't changed.
+int twpng_set_quiet_mesg(int quiet)
 {
-  int n;
+	int old;
 
-  for (n = 0; n < 256; n++) {
-    DWORD c;
-    int k;
-
-    c = (DWORD)n;
-    for (k = 0; k < 8; k++)
-      c = c & 1 ? 0xedb88320L ^ (c >> 1):c >> 1;
+	old = quiet_mesg;
+	quiet_mesg = quiet;
+	return old;
+}
 
-    globals.crc_table[n] = c;
-  }
+void twpng_reset_quiet_mesg()
+{
+	quiet_mesg_count = 0;
+	quiet_mesg_buf[0] = '\0';
 }
 
+// Save the current quiet-mode setting and messages in *st, then turn on
+// quiet mode with no messages. For a function that wants to collect its own
+// messages without losing its caller's.
+void twpng_push_quiet_mesg(struct twpng_quiet_state *st)
+{
+	st->quiet = quiet_mesg;
+	st->count = quiet_mesg_count;
+	StringCchCopy(st->buf,256,quiet_mesg_buf);
+	quiet_mesg = 1;
+	twpng_reset_quiet_mesg();
+}
 
-DWORD update_crc(DWORD crc, unsigned char *buf, int len)
+// Put back what twpng_push_quiet_mesg() saved.
+void twpng_pop_quiet_mesg(const struct twpng_quiet_state *st)
 {
-  DWORD c = crc;
-  unsigned char *p = buf;
-  int n = len;
+	quiet_mesg = st->quiet;
+	quiet_mesg_count = st->count;
+	StringCchCopy(quiet_mesg_buf,256,st->buf);
+}
 
-  if (n > 0) do {
-    c = globals.crc_table[(c ^ (*p++)) & 0xff] ^ (c >> 8);
-  } while (--n);
-  return c;
+// Returns the number of messages since the last reset.
+int twpng_get_quiet_mesg(TCHAR *buf, int buflen)
+{
+	StringCchCopy(buf,buflen,quiet_mesg_buf);
+	return quiet_mesg_count;
 }
 
 void mesg(int severity, const TCHAR *fmt, ...)
@@ -117,6 +152,14 @@ void mesg(int severity, const TCHAR *fmt, ...)
 	StringCbVPrintf(buf,sizeof(buf),fmt,ap);
 	va_end(ap);
 
+	if(quiet_mesg) {
+		if(quiet_mesg_count==0) {
+			StringCchCopy(quiet_mesg_buf,256,buf);
+		}
+		quiet_mesg_count++;
+		return;
+	}
+
 	switch(severity) {
 	case MSG_S: t=_T("Error");   flags=MB_ICONERROR;        break;
 	case MSG_W: t=_T("Warning"); flags=MB_ICONWARNING;      break;
@@ -237,10 +280,10 @@ void Png::fill_listbox(HWND hwnd)
 	}
 }
 
-DWORD Png::get_file_size()
+ULONGLONG Png::get_file_size()
 {
 	int i;
-	DWORD s=0;
+	ULONGLONG s=0;
 
 	// calculate new file size
 	s=8;   // the file signature
@@ -264,7 +307,7 @@ static void update_viewer_filename()
 static void update_status_bar_and_viewer()
 {
 	TCHAR buf[100];
-	DWORD s;
+	ULONGLONG s;
 	TCHAR *type;
 
 	if(!globals.hwndStBar) { goto done; }
@@ -282,12 +325,12 @@ static void update_status_bar_and_viewer()
 
 	s=png->get_file_size();
 
-	StringCchPrintf(buf,100,_T("%s file size: %u bytes"),type,(unsigned int)s);
+	StringCchPrintf(buf,100,_T("%s file size: %I64u bytes"),type,s);
 	SetWindowText(globals.hwndStBar,buf);
 
 done:
 	if(g_viewer) {
-		SetTimer(globals.hwndMain,1,UPDATE_DELAY,NULL);
+		SetTimer(globals.hwndMain,TWPNG_TIMER_VIEWER,UPDATE_DELAY,NULL);
 		globals.timer_set=1;
 	}
 }
@@ -301,90 +344,150 @@ void Png::modified()
 	update_status_bar_and_viewer();
 }
 
-int Png::write_to_mem(unsigned char **pmem, int *plen)
+SerializedView::SerializedView(Png *png)
 {
-	int s;
+	unsigned char *p;
+	Chunk *c;
 	int i;
-	int pos;
 
-	unsigned char *m;
+	m_valid=0;
+	m_num_spans=0;
+	m_size=0;
+	m_hdrbuf=(unsigned char*)malloc(8+12*(size_t)png->m_num_chunks);
+	m_spans=(struct twpng_span*)malloc((2+2*(size_t)png->m_num_chunks)*sizeof(struct twpng_span));
+	if(!m_hdrbuf || !m_spans) return;
+
+	memcpy(m_hdrbuf,png->signature,8);
+	add_span(m_hdrbuf,NULL,8);
 
-	// create an image of the file in memory
-	s=get_file_size();
+	p=&m_hdrbuf[8];
+	for(i=0;i<png->m_num_chunks;i++) {
+		c=png->chunk[i];
+		write_int32(&p[0],c->length);
+		memcpy(&p[4],c->m_chunktype_ascii,4);
+		add_span(p,NULL,8);
+		if(c->length>0) {
+			if(c->m_data_deferred)
+				add_span(NULL,c,c->length);
+			else
+				add_span(c->data,NULL,c->length);
+		}
+		write_int32(&p[8],c->m_crc);
+		add_span(&p[8],NULL,4);
+		p+=12;
+	}
+	m_valid=1;
+}
 
-	m=(unsigned char*)malloc(s);
-	if(!m) return 0;
+SerializedView::~SerializedView()
+{
+	if(m_spans) free(m_spans);
+	if(m_hdrbuf) free(m_hdrbuf);
+}
 
-	CopyMemory(m,signature,8);
+// Adds a span, or extends the last one if this one follows it in memory.
+void SerializedView::add_span(const unsigned char *data, Chunk *c, DWORD len)
+{
+	struct twpng_span *prev;
 
-	pos=8;
-	for(i=0;i<m_num_chunks;i++) {
-		chunk[i]->copy_to_memory(&m[pos]);
-		pos+= 12+chunk[i]->length;
+	m_size += len;
+	if(data && m_num_spans>0) {
+		prev=&m_spans[m_num_spans-1];
+		if(prev->data && prev->data+prev->len==data) {
+			prev->len+=len;
+			return;
+		}
 	}
+	m_spans[m_num_spans].data=data;
+	m_spans[m_num_spans].c=c;
+	m_spans[m_num_spans].len=len;
+	m_num_spans++;
+}
+
+// Copy len bytes from position offset in span i.
+// Returns 0 if they couldn't be read from the file.
+int SerializedView::read(int i, DWORD offset, unsigned char *buf, DWORD len)
+{
+	struct twpng_span *s;
 
-	*pmem = m;
-	*plen = s; // should also = pos
+	s=&m_spans[i];
+	if(offset>s->len || len>s->len-offset) return 0;
+	if(!s->data) return s->c->get_data_segment(offset,buf,len);
+	memcpy(buf,&s->data[offset],len);
 	return 1;
 }
 
-// Call before a sequence of stream_file_read() calls.
+// Write all the spans. Data that is still in the source file is copied a
+// piece at a time. Doesn't flush the writer.
+// Returns 0 on failure.
+int SerializedView::write_to(ChunkWriter *w)
+{
+	unsigned char *dbuf=NULL;
+	DWORD pos, n;
+	int ret=1;
+	int i;
+
+	for(i=0;ret && i<m_num_spans;i++) {
+		if(m_spans[i].data) {
+			ret=w->write(m_spans[i].data,m_spans[i].len);
+			continue;
+		}
+		if(!dbuf) {
+			dbuf=(unsigned char*)malloc(TWPNG_DEFERRED_BUFSIZE);
+			if(!dbuf) { ret=0; break; }
+		}
+		for(pos=0;ret && pos<m_spans[i].len;pos+=n) {
+			n=m_spans[i].len-pos;
+			if(n>TWPNG_DEFERRED_BUFSIZE) n=TWPNG_DEFERRED_BUFSIZE;
+			ret = read(i,pos,dbuf,n) && w->write(dbuf,n);
+		}
+	}
+	if(dbuf) free(dbuf);
+	return ret;
+}
+
+// Call before a sequence of stream_file_read() calls, and call
+// stream_file_end() after them. The chunks mustn't be changed in between.
 void Png::stream_file_start()
 {
-	m_stream_phase = 0;
-	m_stream_curchunk = 0; // -1 means we're reading the signature
-	m_stream_curpos_in_curchunk = 0;
+	stream_file_end();
+	m_stream_view=new SerializedView(this);
+	m_stream_span=0;
+	m_stream_pos=0;
+}
+
+void Png::stream_file_end()
+{
+	if(m_stream_view) {
+		delete m_stream_view;
+		m_stream_view=NULL;
+	}
 }
 
-// Starting at position m_stream_curpos_in_curchunk in chunk m_stream_curchunk,
-// copy nbytes bytes of the PNG file into buf (unless end of file is reached).
-// This may require reading from the following chunk(s).
+// Copy the next bytes_requested bytes of the PNG file into buf (unless end
+// of file is reached). Chunk data that is still in the source file is read
+// from it as needed, not loaded into memory.
 // Returns the number of bytes copied.
 DWORD Png::stream_file_read(unsigned char *buf, DWORD bytes_requested)
 {
+	SerializedView *v;
 	DWORD total_bytes_copied=0; // bytes copied in this call to stream_file_read
-	DWORD nread;
-	DWORD bytes_to_copy;
-
-	// Read the file signature, if necessary.
-	if(m_stream_phase==0) {
-		bytes_to_copy = 8-m_stream_curpos_in_curchunk;
-		if(bytes_to_copy>bytes_requested) bytes_to_copy=bytes_requested;
-
-		CopyMemory(buf,&signature[m_stream_curpos_in_curchunk],bytes_to_copy);
-		m_stream_curpos_in_curchunk+=bytes_to_copy;
-		total_bytes_copied+=bytes_to_copy;
-		if(total_bytes_copied>=8) {
-			// Done reading signature. Now switch to reading chunks.
-			m_stream_phase=1;
-			m_stream_curchunk=0;
-			m_stream_curpos_in_curchunk=0;
-		}
-		else {
-			goto done;
-		}
-	}
-
-	// Read the chunk(s).
-	while(1) {
-		if(total_bytes_copied>=bytes_requested) goto done;
-
-		if(m_stream_curchunk>=m_num_chunks) goto done;
+	DWORD n;
 
-		if(m_stream_curpos_in_curchunk >= chunk[m_stream_curchunk]->length+12) {
-			// advance to next chunk
-			m_stream_curchunk++;
-			m_stream_curpos_in_curchunk=0;
-			if(m_stream_curchunk>=m_num_chunks) goto done;
+	v=m_stream_view;
+	if(!v || !v->m_valid) return 0;
+
+	while(total_bytes_copied<bytes_requested && m_stream_span<v->m_num_spans) {
+		n=v->m_spans[m_stream_span].len-m_stream_pos;
+		if(n>bytes_requested-total_bytes_copied) n=bytes_requested-total_bytes_copied;
+		if(!v->read(m_stream_span,m_stream_pos,&buf[total_bytes_copied],n)) break;
+		total_bytes_copied+=n;
+		m_stream_pos+=n;
+		if(m_stream_pos>=v->m_spans[m_stream_span].len) {
+			m_stream_span++;
+			m_stream_pos=0;
 		}
-	
-		nread = chunk[m_stream_curchunk]->copy_segment_to_memory(&buf[total_bytes_copied],
-			m_stream_curpos_in_curchunk, bytes_requested-total_bytes_copied);
-		m_stream_curpos_in_curchunk+=nread;
-		total_bytes_copied+=nread;
 	}
-
-done:
 	return total_bytes_copied;
 }
 
@@ -603,6 +706,13 @@ void Png::new_chunk(int newid)
 		c->data[8]=0;
 		break;
 
+	case CHUNK_twPd:
+		// Just before the image data.
+		if(!find_first_chunk(CHUNK_IDAT,&pos)) pos=m_num_chunks-1;
+		c->length=TWPNG_PAD_SIZE;
+		c->data = (unsigned char*)calloc(c->length,1);
+		break;
+
 	default:
 		ok=0;
 	}
@@ -651,227 +761,1646 @@ void Png::edit_chunk(int n)
 	}
 }
 
-// save to disk
-// returns 1 on success, 0 on failure
-int Png::write_file(const TCHAR *fn)
+ChunkWriter::ChunkWriter(HANDLE fh, DWORD bufsize)
 {
-	int i;
-	HCURSOR hcur;
-	DWORD written;
-	HANDLE fh;
-
-	fh=CreateFile(fn,GENERIC_WRITE,0,NULL,CREATE_ALWAYS,
-		FILE_ATTRIBUTE_NORMAL,NULL);
-	if(fh==INVALID_HANDLE_VALUE) {
-		mesg(MSG_E,_T("Can") SYM_RSQUO _T("t write file (%s)"),fn);
-		return 0;
-	}
+	m_fh=fh;
+	m_failed=0;
+	m_buflen=0;
+	m_bufsize=bufsize;
+	m_buf=(unsigned char*)malloc(m_bufsize);
+	// If that failed, everything will be written directly.
+}
 
-	hcur=SetCursor(LoadCursor(NULL,IDC_WAIT));
+// Anything not flush()ed is lost.
+ChunkWriter::~ChunkWriter()
+{
+	if(m_buf) free(m_buf);
+}
 
-	WriteFile(fh,(LPVOID)signature,8,&written,NULL);
+int ChunkWriter::write_direct(const unsigned char *buf, DWORD len)
+{
+	DWORD written;
 
-	for(i=0;i<m_num_chunks;i++) {
-		chunk[i]->write_to_file(fh,0);
+	if(m_failed) return 0;
+	if(!WriteFile(m_fh,(LPCVOID)buf,len,&written,NULL) || written!=len) {
+		m_failed=1;
+		return 0;
 	}
-	CloseHandle(fh);
-	SetCursor(hcur);
 	return 1;
 }
 
-// make sure we have room for have n chunks in the chunk[] array
-void Png::init_new_chunk(int n)   
+// Small writes are saved up in the buffer. Big ones are written directly,
+// after whatever is already in the buffer.
+// Returns 0 if there has been a write error.
+int ChunkWriter::write(const unsigned char *buf, DWORD len)
 {
-	if(n<m_chunks_alloc) return;
-	// oops -- overran our chunks array. try to alloc a bigger one
-	m_chunks_alloc += 200;
-	chunk=(Chunk**)realloc((void*)chunk, m_chunks_alloc*sizeof(Chunk*));
-	if(!chunk) {
-		mesg(MSG_S,_T("can") SYM_RSQUO _T("t alloc memory for chunks array"));
-		m_num_chunks=0;
+	if(m_failed) return 0;
+	if(len==0) return 1;
+
+	if(m_buf && len<=m_bufsize-m_buflen) {
+		memcpy(&m_buf[m_buflen],buf,len);
+		m_buflen+=len;
+		return 1;
 	}
-}
 
-void Png::delete_chunk(int n)
-{
-	int i;
-	if(n<0 || n>=m_num_chunks) return;
+	if(!flush()) return 0;
 
-	delete chunk[n];
-	for(i=n+1;i<m_num_chunks;i++) {
-		chunk[i-1]=chunk[i];
+	if(!m_buf || len>=m_bufsize) {
+		return write_direct(buf,len);
 	}
-	m_num_chunks--;
+	memcpy(m_buf,buf,len);
+	m_buflen=len;
+	return 1;
 }
 
-void Png::move_chunk(int n, int delta)  // move chunk n by delta
+// Returns 0 if there has been a write error.
+int ChunkWriter::flush()
 {
-	Chunk *tmpchunk;
-	int moveto;
-	int i;
-
-	if(n<0 || n>=m_num_chunks) return;
-	moveto=n+delta;
+	DWORD n;
 
-	if(moveto<0) moveto=0;
-	if(moveto>=m_num_chunks) moveto=m_num_chunks-1;
+	n=m_buflen;
+	m_buflen=0;
+	if(n==0) return !m_failed;
+	return write_direct(m_buf,n);
+}
 
-	if(moveto==n) return;
+// Write what's buffered, then move to pos in the file.
+// Returns 0 if there has been a write error.
+int ChunkWriter::seek(ULONGLONG pos)
+{
+	LARGE_INTEGER li;
 
-	if(moveto>n) {        // move down
-		for(i=0;i<(moveto-n);i++) {
-			tmpchunk=chunk[n+i];       //swap(n+i,n+i+1)
-			chunk[n+i]=chunk[n+i+1];
-			chunk[n+i+1]=tmpchunk;
-		}
-	}
-	else {        // move up      (moveto < n)
-		for(i=(n-moveto-1);i>=0;i--) {
-			tmpchunk=chunk[moveto+i];   //swap(moveto+i+1,moveto+i)
-			chunk[moveto+i]=chunk[moveto+i+1];
-			chunk[moveto+i+1]=tmpchunk;
-		}
+	if(!flush()) return 0;
+	li.QuadPart = (LONGLONG)pos;
+	if(!SetFilePointerEx(m_fh,li,NULL,FILE_BEGIN)) {
+		m_failed=1;
+		return 0;
 	}
+	return 1;
 }
 
+// Write the signature and all the chunks, from the start of the file.
+// Returns 0 on failure.
+int Png::write_all(ChunkWriter *w)
+{
+	SerializedView *v;
+	int ret;
 
-static const unsigned char sig_png[] = {137,80,78,71,13,10,26,10};
-static const unsigned char sig_mng[] = {138,77,78,71,13,10,26,10};
-static const unsigned char sig_jng[] = {139,74,78,71,13,10,26,10};
+	// Don't copy a bad crc that hasn't been noticed yet.
+	verify_crcs(0);
 
-void Png::set_signature()
-{
-	switch(m_imgtype) {
-	case IMG_PNG: memcpy(signature,sig_png,8); break;
-	case IMG_MNG: memcpy(signature,sig_mng,8); break;
-	case IMG_JNG: memcpy(signature,sig_jng,8); break;
+	v=new SerializedView(this);
+	if(!v->m_valid) {
+		delete v;
+		mesg(MSG_S,_T("Can") SYM_RSQUO _T("t allocate memory"));
+		return 0;
 	}
+	ret = v->write_to(w) && w->flush();
+	delete v;
+	return ret;
 }
 
-int Png::read_signature(HANDLE fh)
+// Write the whole file to a handle that the caller has opened (see
+// BatchSaver). Returns 1 on success, 0 on failure.
+int Png::write_to_handle(HANDLE fh)
 {
-	DWORD n;
-	int r;
+	ChunkWriter *w;
+	int ret;
 
-	r=ReadFile(fh,(LPVOID)signature,8,&n,NULL);
-	if(!r || n<8) return 0;
-	if(!memcmp(signature,sig_png,8)) return IMG_PNG;
-	if(!memcmp(signature,sig_mng,8)) return IMG_MNG;
-	if(!memcmp(signature,sig_jng,8)) return IMG_JNG;
-	return IMG_UNKNOWN;
+	if(m_partial) {
+		mesg(MSG_E,_T("Only the first part of this file was loaded, so it can") SYM_RSQUO _T("t be saved."));
+		return 0;
+	}
+
+	w=new ChunkWriter(fh);
+	ret=write_all(w);
+	if(!ret && w->m_failed) {
+		mesg(MSG_E,_T("Error writing file"));
+	}
+	delete w;
+	return ret;
 }
 
-int Png::read_next_chunk(HANDLE fh, DWORD *filepos)
+// save to disk
+// returns 1 on success, 0 on failure
+// If fn is the file that was loaded (or last saved), it's updated in place
+// if possible (see save_in_place()), or else replaced.
+int Png::write_file(const TCHAR *fn, unsigned int flags)
 {
-	DWORD n;
-	Chunk *c;
-	unsigned char fbuf[8];
-	DWORD ccrc;
-	int r;
-	int i;
+	HCURSOR hcur;
+	HANDLE fh;
+	TCHAR fullfn[MAX_PATH];
+	ChunkWriter *w;
+	int ret;
 
-	// first 4 bytes are the chunk data length,
-	// next 4 bytes are the chunk type
-	r=ReadFile(fh,(LPVOID)fbuf,8,&n,NULL);
-	if(!r || n==0) {  // this is normal; we've reached the end of file
+	if(m_partial) {
+		mesg(MSG_E,_T("Only the first part of this file was loaded, so it can") SYM_RSQUO _T("t be saved."));
 		return 0;
 	}
 
-	if(n!=8) {
-		mesg(MSG_W,_T("Garbage found at end of file"));
-		return 0;
+	if(!GetFullPathName(fn,MAX_PATH,fullfn,NULL)) {
+		StringCchCopy(fullfn,MAX_PATH,_T(""));
 	}
 
-	// allocate a Chunk structure for this new chunk
-	c = new Chunk();
+	if(fullfn[0] && !(flags & TWPNG_WRITE_COPY) && absorb_padding()) {
+		fill_listbox(globals.hwndMainList);
+	}
 
-	c->m_parentpng = this;  // chunks sometimes depend other chunks, ...
+	if(fullfn[0] && m_layoutfilename[0] && !lstrcmpi(fullfn,m_layoutfilename) &&
+		!(flags & TWPNG_WRITE_COPY))
+	{
+		hcur=SetCursor(LoadCursor(NULL,IDC_WAIT));
+		ret=save_in_place(fullfn);
+		if(ret<0) ret=save_by_replacing(fullfn);
+		SetCursor(hcur);
+		return ret;
+	}
 
-	c->length= read_int32(&fbuf[0]);
+	if(fullfn[0] && !(flags & TWPNG_WRITE_COPY)) {
+		hcur=SetCursor(LoadCursor(NULL,IDC_WAIT));
+		ret=save_by_copying(fullfn);
+		SetCursor(hcur);
+		if(ret>=0) return ret;
+	}
 
-	memcpy(c->m_chunktype_ascii,&fbuf[4],4);
-	c->m_chunktype_ascii[4]='\0';  // null-terminate for convenience
-	for(i=0;i<4;i++) {
-		if( !((c->m_chunktype_ascii[i]>='a' && c->m_chunktype_ascii[i]<='z') ||
-			(c->m_chunktype_ascii[i]>='A' && c->m_chunktype_ascii[i]<='Z')))
+	// We can't overwrite a file that we still have mapped, or still need
+	// to read from.
+	// (If the filenames don't match but it's really the same file, the
+	// CreateFile call below will fail, which is safe enough.)
+	if(m_srcview || m_srcfh!=INVALID_HANDLE_VALUE) {
+		if(!fullfn[0] || !lstrcmpi(fullfn,m_srcfilename))
 		{
-			mesg(MSG_W,_T("Invalid chunk type found at file position %u. ")
-				_T("This may indicate garbage at the end of the file."),*filepos);
-			delete c;
-			return 0;
+			if(!release_source_file()) return 0;
 		}
 	}
-	c->set_chunktype_tchar_from_ascii();
 
-	// now read the data
-	if(c->length>0) {
+	fh=CreateFile(fn,GENERIC_WRITE,0,NULL,CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,NULL);
+	if(fh==INVALID_HANDLE_VALUE) {
+		mesg(MSG_E,_T("Can") SYM_RSQUO _T("t write file (%s)"),fn);
+		return 0;
+	}
 
-		// A sanity test for the chunk length.
-		if(c->length > m_pngfilesize - *filepos - 12) {
-			mesg(MSG_W,_T("Bogus chunk length found. This may indicate garbage at the end of the file."));
-			delete c;
-			return 0;
-		}
+	hcur=SetCursor(LoadCursor(NULL,IDC_WAIT));
 
-		c->data = (unsigned char*)malloc(c->length);
-		if(!c->data) {
-			mesg(MSG_S,_T("Can") SYM_RSQUO _T("t allocate memory for chunk"));
-			delete c;
-			return 0;
-		}
+	w=new ChunkWriter(fh);
+	ret=write_all(w);
+	if(!ret && w->m_failed) {
+		mesg(MSG_E,_T("Error writing file (%s)"),fn);
 	}
+	delete w;
+	CloseHandle(fh);
+	SetCursor(hcur);
 
-	r=ReadFile(fh,(LPVOID)c->data,c->length,&n,NULL);
-	if(!r || n!=c->length) {
-		mesg(MSG_W,_T("Garbage found at end of file"));
-		delete c;
-		return 0;
+	if(ret && fullfn[0] && !(flags & TWPNG_WRITE_COPY)) {
+		set_layout(fullfn);
 	}
+	return ret;
+}
 
-	// now read the CRC
-	r=ReadFile(fh,(LPVOID)fbuf,4,&n,NULL);
-	if(!r || n!=4) {
-		mesg(MSG_W,_T("Garbage found at end of file"));
-		delete c;
-		return 0;
-	}
+// If there's a twPd (padding) chunk before the image data, grow or shrink
+// it to make up for any change in the size of the chunks before the image
+// data, so that the image data stays where it is in the layout file, and
+// the file can be saved in place without rewriting it.
+// Returns 1 if the padding was changed.
+int Png::absorb_padding()
+{
+	Chunk *c;
+	Chunk *pad=NULL;
+	ULONGLONG pos;
+	LONGLONG newlen;
+	unsigned char *newdata=NULL;
+	int i;
 
-	c->m_crc = read_int32(&fbuf[0]);
+	if(!m_layoutfilename[0]) return 0;
 
-	// check the crc
-	ccrc=c->calc_crc();
+	pos=8;
+	for(i=0;i<m_num_chunks;i++) {
+		c=chunk[i];
+		if(c->m_chunktype_id==CHUNK_IDAT || c->m_chunktype_id==CHUNK_JDAT) break;
+		if(c->m_chunktype_id==CHUNK_twPd) pad=c;
+		pos += 12+(ULONGLONG)c->length;
+	}
+	if(i>=m_num_chunks || !pad) return 0;
+	if(chunk[i]->m_filepos==TWPNG_NO_FILEPOS || chunk[i]->m_filepos==pos) return 0;
+
+	// If the chunks before the image data have grown by more than the
+	// size of the padding, it can't help.
+	newlen = (LONGLONG)pad->length - ((LONGLONG)pos - (LONGLONG)chunk[i]->m_filepos);
+	if(newlen<0 || newlen>TWPNG_MAX_CHUNK_LENGTH) return 0;
+
+	if(newlen>0) {
+		newdata=(unsigned char*)calloc((size_t)newlen,1);
+		if(!newdata) return 0;
+	}
+	pad->free_data();
+	pad->data=newdata;
+	pad->length=(DWORD)newlen;
+	pad->chunkmodified();
+	return 1;
+}
+
+// Remember that the chunks are now in the named file, one after another,
+// as write_all() writes them.
+void Png::set_layout(const TCHAR *fullfn)
+{
+	ULONGLONG pos;
+	int i;
 
-	if(c->m_crc != ccrc) {
-		mesg(MSG_W,_T("Incorrect crc for %s chunk (is %08x, should be %08x)"),
-			c->m_chunktype_tchar, c->m_crc, ccrc);
-		c->m_crc=ccrc;  // correct it
+	pos=8;
+	for(i=0;i<m_num_chunks;i++) {
+		chunk[i]->m_filepos=pos;
+		chunk[i]->m_filecrc=chunk[i]->m_crc;
+		chunk[i]->m_file_stale=0;
+		pos += 12+(ULONGLONG)chunk[i]->length;
 	}
 
-	init_new_chunk(m_num_chunks);  // make sure chunks array is large enough
-	chunk[m_num_chunks++]=c;
+	StringCchCopy(m_layoutfilename,MAX_PATH,fullfn);
+	if(!get_file_stamp(fullfn,&m_layoutsize,&m_layouttime)) {
+		StringCchCopy(m_layoutfilename,MAX_PATH,_T(""));
+	}
+}
 
-	c->after_init();
+// Stop using the source file, so that it can be written to or replaced,
+// but without reading the data that is still in it. Chunks whose data is in
+// the file view are changed to read it from the file when it's needed, as
+// with TWPNG_LOAD_LAZY. Call reattach_source() afterward.
+void Png::detach_source()
+{
+	int i;
 
-	*filepos += c->length + 12;
-	return 1;
+	if(m_srcview) {
+		for(i=0;i<m_num_chunks;i++) {
+			if(chunk[i]->m_data_mapped) {
+				chunk[i]->m_srcpos=(ULONGLONG)(chunk[i]->data-m_srcview);
+				chunk[i]->data=NULL;
+				chunk[i]->m_data_mapped=0;
+				chunk[i]->m_data_deferred=1;
+			}
+		}
+		UnmapViewOfFile(m_srcview);
+		m_srcview=NULL;
+		CloseHandle(m_srcmapping);
+		m_srcmapping=NULL;
+	}
+	if(m_srcfh!=INVALID_HANDLE_VALUE) {
+		CloseHandle(m_srcfh);
+		m_srcfh=INVALID_HANDLE_VALUE;
+	}
 }
 
-Png::Png()
+// Open the source file again, if any chunks still need to read from it.
+// Returns 0 if it can't be opened.
+int Png::reattach_source(const TCHAR *fullfn)
 {
-	m_num_chunks=0;
-	chunk=NULL;
-	m_chunks_alloc=0;
-	StringCchCopy(m_filename,MAX_PATH,_T("untitled"));
-	m_named=0;
-	m_dirty=0;
+	int i;
 
-	chunk=(Chunk**)malloc(200*sizeof(Chunk*));
-	m_chunks_alloc=200;
-	m_imgtype=IMG_PNG;
+	for(i=0;i<m_num_chunks;i++) {
+		if(chunk[i]->m_data_deferred) break;
+	}
+	if(i>=m_num_chunks) return 1;
 
-	m_width=1;
-	m_height=1;
-	m_bitdepth=1;
+	m_srcfh=CreateFile(fullfn,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,NULL);
+	if(m_srcfh==INVALID_HANDLE_VALUE) {
+		mesg(MSG_E,_T("Can") SYM_RSQUO _T("t reopen file (%s)"),fullfn);
+		return 0;
+	}
+	StringCchCopy(m_srcfilename,MAX_PATH,fullfn);
+	return 1;
+}
+
+// Save over the layout file, writing as little as possible. Chunks that are
+// still in the same place in the file are skipped if they haven't changed,
+// and overwritten if they have. Chunks that have moved (because something
+// before them changed size, or was inserted or deleted) are rewritten. So
+// changing a chunk after the image data doesn't mean rewriting the image
+// data, and neither does changing one before it, if a padding chunk takes
+// up the difference (see absorb_padding()).
+// This isn't atomic, so it is only used if the file is as we left it.
+// Returns 1 if saved, 0 on error, or -1 if it can't be done this way (in
+// which case nothing was written).
+int Png::save_in_place(const TCHAR *fullfn)
+{
+	HANDLE fh;
+	ChunkWriter *w;
+	Chunk *c;
+	ULONGLONG size;
+	FILETIME t;
+	ULONGLONG pos;
+	ULONGLONG wpos;  // where the writer is
+	ULONGLONG movedbytes;
+	unsigned char buf[8];
+	int same_source;
+	int moved;
+	int ret;
+	int i;
+
+	// If another program has changed the file, we don't know what's in it.
+	if(!get_file_stamp(fullfn,&size,&t)) return -1;
+	if(size!=m_layoutsize || CompareFileTime(&t,&m_layouttime)) return -1;
+
+	// Check the crcs of the chunks that are going to be written. (A chunk
+	// whose crc is corrected then counts as changed, and is written too.)
+	verify_crcs(1);
+
+	// Data that is still in the file has to be read before it's written
+	// over, if the chunk has moved.
+	same_source = (m_srcview || m_srcfh!=INVALID_HANDLE_VALUE) &&
+		!lstrcmpi(m_srcfilename,fullfn);
+	if(same_source) {
+		movedbytes=0;
+		pos=8;
+		for(i=0;i<m_num_chunks;i++) {
+			c=chunk[i];
+			if(c->m_filepos!=pos && (c->m_data_mapped || c->m_data_deferred))
+				movedbytes += c->length;
+			pos += 12+(ULONGLONG)c->length;
+		}
+		if(movedbytes>TWPNG_INPLACE_MAX_TAIL) return -1;
+
+		pos=8;
+		for(i=0;i<m_num_chunks;i++) {
+			c=chunk[i];
+			if(c->m_filepos!=pos && !c->make_data_private()) return -1;
+			pos += 12+(ULONGLONG)c->length;
+		}
+		detach_source();
+
+		// Changed chunks that haven't moved, whose data is still in the
+		// file, should have it in the same place.
+		pos=8;
+		for(i=0;i<m_num_chunks;i++) {
+			c=chunk[i];
+			if(c->m_data_deferred && c->m_srcpos!=pos+8 &&
+				(c->m_crc!=c->m_filecrc || c->m_file_stale))
+			{
+				reattach_source(fullfn);
+				return -1;
+			}
+			pos += 12+(ULONGLONG)c->length;
+		}
+	}
+
+	fh=CreateFile(fullfn,GENERIC_READ|GENERIC_WRITE,FILE_SHARE_READ,NULL,OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,NULL);
+	if(fh==INVALID_HANDLE_VALUE) {
+		if(same_source) reattach_source(fullfn);
+		return -1;
+	}
+
+	w=new ChunkWriter(fh);
+	ret=1;
+	wpos=0;
+
+	if(!read_file_at(fh,0,buf,8)) ret=0;
+	else if(memcmp(buf,signature,8)) {
+		ret = w->seek(0) && w->write(signature,8);
+		wpos=8;
+	}
+
+	pos=8;
+	for(i=0;ret && i<m_num_chunks;i++) {
+		c=chunk[i];
+		moved = (c->m_filepos!=pos);
+		if(!moved && c->m_crc==c->m_filecrc && !c->m_file_stale) {
+			;  // unchanged
+		}
+		else if(!moved && same_source && c->m_data_deferred) {
+			// The data in the file is still right; only the type or crc
+			// has changed.
+			write_int32(&buf[0],c->length);
+			memcpy(&buf[4],c->m_chunktype_ascii,4);
+			ret = w->seek(pos) && w->write(buf,8);
+			write_int32(&buf[0],c->m_crc);
+			if(ret) ret = w->seek(pos+8+c->length) && w->write(buf,4);
+			wpos=pos+12+c->length;
+		}
+		else {
+			// Consecutive chunks are written without seeking, so that
+			// they're buffered together.
+			if(wpos!=pos) ret=w->seek(pos);
+			if(ret) ret=c->write_to_file(w,0);
+			wpos=pos+12+c->length;
+		}
+		pos += 12+(ULONGLONG)c->length;
+	}
+
+	// Cut off (or extend) the file at the end of the last chunk.
+	if(ret) ret=w->seek(pos);
+	if(ret) ret=SetEndOfFile(fh) ? 1 : 0;
+
+	delete w;
+	CloseHandle(fh);
+	if(same_source) reattach_source(fullfn);
+
+	if(!ret) {
+		mesg(MSG_E,_T("Error writing file (%s)"),fullfn);
+		StringCchCopy(m_layoutfilename,MAX_PATH,_T(""));  // don't know what's in it now
+		return 0;
+	}
+	set_layout(fullfn);
+	return 1;
+}
+
+// Save to a different file by copying the layout file, and then updating
+// the copy in place. Most of the file is then copied by CopyFile, which
+// doesn't have to bring the data through this process, and which can
+// leave the copying to the file server, or to a file system that can share
+// the data between the two files.
+// This is only worth doing if most of the file is still in the same place.
+// Returns 1 if saved, 0 on error, or -1 if it can't be done this way.
+int Png::save_by_copying(const TCHAR *fullfn)
+{
+	TCHAR oldfn[MAX_PATH];
+	ULONGLONG oldsize;
+	FILETIME oldtime;
+	ULONGLONG size;
+	FILETIME t;
+	ULONGLONG pos;
+	ULONGLONG same;  // bytes that are still in the same place
+	int ret;
+	int i;
+
+	if(!m_layoutfilename[0]) return -1;
+
+	// Overwriting the source file is handled by write_file().
+	if((m_srcview || m_srcfh!=INVALID_HANDLE_VALUE) && !lstrcmpi(fullfn,m_srcfilename))
+		return -1;
+
+	if(!get_file_stamp(m_layoutfilename,&size,&t)) return -1;
+	if(size!=m_layoutsize || CompareFileTime(&t,&m_layouttime)) return -1;
+
+	// Find out how much of the file is still in the same place.
+	pos=8;
+	same=8;
+	for(i=0;i<m_num_chunks;i++) {
+		if(chunk[i]->m_filepos==pos) same += 12+(ULONGLONG)chunk[i]->length;
+		pos += 12+(ULONGLONG)chunk[i]->length;
+	}
+	if(same < pos-same) return -1;
+
+	if(!CopyFile(m_layoutfilename,fullfn,FALSE)) return -1;
+
+	// The copy has the same layout as the original.
+	StringCchCopy(oldfn,MAX_PATH,m_layoutfilename);
+	oldsize=m_layoutsize;
+	oldtime=m_layouttime;
+	StringCchCopy(m_layoutfilename,MAX_PATH,fullfn);
+	if(!get_file_stamp(fullfn,&m_layoutsize,&m_layouttime)) {
+		ret=-1;
+	}
+	else {
+		ret=save_in_place(fullfn);
+	}
+	if(ret<0) {
+		StringCchCopy(m_layoutfilename,MAX_PATH,oldfn);
+		m_layoutsize=oldsize;
+		m_layouttime=oldtime;
+	}
+	return ret;
+}
+
+// Save by writing a new file in the same directory, and then replacing the
+// old file with it, so the old file is left alone if anything goes wrong.
+// Returns 1 on success, 0 on failure.
+// Give a new file (tofn) the attributes and permissions of the file it's
+// about to be renamed over (fromfn), which the rename wouldn't keep. Does
+// nothing if fromfn doesn't exist. Other names (hard links) of the old file
+// can't be carried over; they'll still have the old contents.
+void twpng_copy_file_attributes(const TCHAR *fromfn, const TCHAR *tofn)
+{
+	PSECURITY_DESCRIPTOR sd;
+	DWORD attr;
+	DWORD len=0;
+
+	attr=GetFileAttributes(fromfn);
+	if(attr==INVALID_FILE_ATTRIBUTES) return;
+
+	GetFileSecurity(fromfn,DACL_SECURITY_INFORMATION,NULL,0,&len);
+	if(len>0) {
+		sd=(PSECURITY_DESCRIPTOR)malloc(len);
+		if(sd) {
+			if(GetFileSecurity(fromfn,DACL_SECURITY_INFORMATION,sd,len,&len)) {
+				SetFileSecurity(tofn,DACL_SECURITY_INFORMATION,sd);
+			}
+			free(sd);
+		}
+	}
+
+	SetFileAttributes(tofn,attr & (FILE_ATTRIBUTE_ARCHIVE|FILE_ATTRIBUTE_HIDDEN|
+		FILE_ATTRIBUTE_SYSTEM|FILE_ATTRIBUTE_NOT_CONTENT_INDEXED));
+}
+
+int Png::save_by_replacing(const TCHAR *fullfn)
+{
+	TCHAR dir[MAX_PATH];
+	TCHAR tmpfn[MAX_PATH];
+	TCHAR *base;
+	HANDLE fh;
+	ChunkWriter *w;
+	ULONGLONG pos;
+	int same_source;
+	int ret;
+	int i;
+
+	if(!GetFullPathName(fullfn,MAX_PATH,dir,&base) || !base) {
+		mesg(MSG_E,_T("Can") SYM_RSQUO _T("t write file (%s)"),fullfn);
+		return 0;
+	}
+	*base='\0';  // chop off the filename
+
+	if(!GetTempFileName(dir,_T("twp"),0,tmpfn)) {
+		mesg(MSG_E,_T("Can") SYM_RSQUO _T("t create a temporary file in %s"),dir);
+		return 0;
+	}
+	fh=CreateFile(tmpfn,GENERIC_WRITE,0,NULL,CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,NULL);
+	if(fh==INVALID_HANDLE_VALUE) {
+		DeleteFile(tmpfn);
+		mesg(MSG_E,_T("Can") SYM_RSQUO _T("t write file (%s)"),tmpfn);
+		return 0;
+	}
+
+	// Data that is still in the old file is copied from it.
+	w=new ChunkWriter(fh);
+	ret=write_all(w);
+	delete w;
+	// The data has to be on the disk before the file is renamed, or a
+	// crash could leave an empty file in place of the old one.
+	if(ret) ret = FlushFileBuffers(fh) ? 1 : 0;
+	CloseHandle(fh);
+	if(!ret) {
+		DeleteFile(tmpfn);
+		mesg(MSG_E,_T("Error writing file (%s)"),tmpfn);
+		return 0;
+	}
+	twpng_copy_file_attributes(fullfn,tmpfn);
+
+	same_source = (m_srcview || m_srcfh!=INVALID_HANDLE_VALUE) &&
+		!lstrcmpi(m_srcfilename,fullfn);
+	if(same_source) detach_source();
+
+	if(!MoveFileEx(tmpfn,fullfn,MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH)) {
+		DeleteFile(tmpfn);
+		if(same_source) reattach_source(fullfn);
+		mesg(MSG_E,_T("Can") SYM_RSQUO _T("t replace file (%s)"),fullfn);
+		return 0;
+	}
+
+	if(same_source) {
+		// The data that was still in the old file is in the new one, in
+		// the new places.
+		pos=8;
+		for(i=0;i<m_num_chunks;i++) {
+			if(chunk[i]->m_data_deferred) chunk[i]->m_srcpos=pos+8;
+			pos += 12+(ULONGLONG)chunk[i]->length;
+		}
+		reattach_source(fullfn);
+	}
+
+	set_layout(fullfn);
+	return 1;
+}
+
+// make sure we have room for have n chunks in the chunk[] array
+void Png::init_new_chunk(int n)   
+{
+	if(n<m_chunks_alloc) return;
+	// oops -- overran our chunks array. try to alloc a bigger one
+	m_chunks_alloc += 200;
+	chunk=(Chunk**)realloc((void*)chunk, m_chunks_alloc*sizeof(Chunk*));
+	if(!chunk) {
+		mesg(MSG_S,_T("can") SYM_RSQUO _T("t alloc memory for chunks array"));
+		m_num_chunks=0;
+	}
+}
+
+void Png::delete_chunk(int n)
+{
+	int i;
+	if(n<0 || n>=m_num_chunks) return;
+
+	delete chunk[n];
+	for(i=n+1;i<m_num_chunks;i++) {
+		chunk[i-1]=chunk[i];
+	}
+	m_num_chunks--;
+}
+
+void Png::move_chunk(int n, int delta)  // move chunk n by delta
+{
+	Chunk *tmpchunk;
+	int moveto;
+	int i;
+
+	if(n<0 || n>=m_num_chunks) return;
+	moveto=n+delta;
+
+	if(moveto<0) moveto=0;
+	if(moveto>=m_num_chunks) moveto=m_num_chunks-1;
+
+	if(moveto==n) return;
+
+	if(moveto>n) {        // move down
+		for(i=0;i<(moveto-n);i++) {
+			tmpchunk=chunk[n+i];       //swap(n+i,n+i+1)
+			chunk[n+i]=chunk[n+i+1];
+			chunk[n+i+1]=tmpchunk;
+		}
+	}
+	else {        // move up      (moveto < n)
+		for(i=(n-moveto-1);i>=0;i--) {
+			tmpchunk=chunk[moveto+i];   //swap(moveto+i+1,moveto+i)
+			chunk[moveto+i]=chunk[moveto+i+1];
+			chunk[moveto+i+1]=tmpchunk;
+		}
+	}
+}
+
+
+static const unsigned char sig_png[] = {137,80,78,71,13,10,26,10};
+static const unsigned char sig_mng[] = {138,77,78,71,13,10,26,10};
+static const unsigned char sig_jng[] = {139,74,78,71,13,10,26,10};
+
+void Png::set_signature()
+{
+	switch(m_imgtype) {
+	case IMG_PNG: memcpy(signature,sig_png,8); break;
+	case IMG_MNG: memcpy(signature,sig_mng,8); break;
+	case IMG_JNG: memcpy(signature,sig_jng,8); break;
+	}
+}
+
+// A twpng_read_cb_type function that reads from a file (or pipe) handle.
+int twpng_file_read_fn(void *userdata, unsigned char *buf, DWORD nbytes)
+{
+	DWORD n;
+
+	if(!ReadFile((HANDLE)userdata,(LPVOID)buf,nbytes,&n,NULL)) {
+		// This is how the end of a pipe is reported.
+		if(GetLastError()==ERROR_BROKEN_PIPE) return 0;
+		return -1;
+	}
+	return (int)n;
+}
+
+// Parse a regular file. If size is known, it's used to detect bogus chunk
+// lengths before trying to allocate memory for them.
+// bufsize is the size of the reads from the file (except for big chunks,
+// which are read all at once).
+ChunkParser::ChunkParser(HANDLE fh, ULONGLONG size, DWORD bufsize)
+{
+	init(twpng_file_read_fn,(void*)fh,bufsize);
+	m_fh=fh;
+	m_seekable=(GetFileType(fh)==FILE_TYPE_DISK);
+	m_size=size;
+	m_size_known=1;
+}
+
+// Parse from any byte source. It's read strictly in order, and its size
+// doesn't need to be known.
+ChunkParser::ChunkParser(twpng_read_cb_type read_fn, void *userdata)
+{
+	init(read_fn,userdata,TWPNG_READBUF_SIZE);
+}
+
+void ChunkParser::init(twpng_read_cb_type read_fn, void *userdata, DWORD bufsize)
+{
+	m_read_fn=read_fn;
+	m_userdata=userdata;
+	m_fh=INVALID_HANDLE_VALUE;
+	m_seekable=0;
+	m_size=0;
+	m_size_known=0;
+	m_pos=0;
+	m_chunkpos=0;
+	m_buflen=0;
+	m_bufpos=0;
+	m_bufsize=bufsize;
+	m_buf=(unsigned char*)malloc(m_bufsize);
+	// If that failed, we'll just read directly from the source.
+}
+
+ChunkParser::~ChunkParser()
+{
+	if(m_buf) free(m_buf);
+}
+
+// Read len bytes, or fewer at the end of the input. If pcrc is not NULL, the
+// crc is updated with the bytes as they're read.
+// Returns the number of bytes read, or -1 if there was a read error.
+int ChunkParser::read(unsigned char *buf, DWORD len, DWORD *pcrc)
+{
+	DWORD total=0;
+	DWORD n;
+	int r;
+
+	while(total<len) {
+		if(m_bufpos<m_buflen) {
+			// Use what's in the buffer first.
+			n=m_buflen-m_bufpos;
+			if(n>len-total) n=len-total;
+			memcpy(&buf[total],&m_buf[m_bufpos],n);
+			m_bufpos+=n;
+		}
+		else if(!m_buf || len-total>=m_bufsize) {
+			// Big reads go straight into the caller's buffer.
+			r=(*m_read_fn)(m_userdata,&buf[total],len-total);
+			if(r<0) return -1;
+			if(r==0) break;
+			n=(DWORD)r;
+		}
+		else {
+			// Refill the buffer.
+			m_bufpos=0;
+			m_buflen=0;
+			r=(*m_read_fn)(m_userdata,m_buf,m_bufsize);
+			if(r<0) return -1;
+			if(r==0) break;
+			m_buflen=(DWORD)r;
+			continue;
+		}
+
+		if(pcrc) *pcrc=update_crc(*pcrc,&buf[total],n);
+		total+=n;
+	}
+
+	m_pos+=total;
+	return (int)total;
+}
+
+// Skip over the next len bytes of the input.
+int ChunkParser::skip(ULONGLONG len)
+{
+	LARGE_INTEGER li;
+	unsigned char tmpbuf[4096];
+	DWORD avail;
+	DWORD n;
+
+	avail=m_buflen-m_bufpos;
+	if(len<=avail) {
+		m_bufpos+=(DWORD)len;
+		m_pos+=len;
+		return 1;
+	}
+	m_bufpos=m_buflen=0;
+	m_pos+=avail;
+	len-=avail;
+
+	if(m_seekable) {
+		li.QuadPart=(LONGLONG)len;
+		if(!SetFilePointerEx(m_fh,li,NULL,FILE_CURRENT)) return 0;
+		m_pos+=len;
+		return 1;
+	}
+
+	// Can't seek, so read and discard it.
+	while(len>0) {
+		n = (len>sizeof(tmpbuf)) ? sizeof(tmpbuf) : (DWORD)len;
+		if(read(tmpbuf,n,NULL)!=(int)n) return 0;
+		len-=n;
+	}
+	return 1;
+}
+
+// Continue reading at position pos of the file. Only works if the input is
+// seekable.
+int ChunkParser::seek(ULONGLONG pos)
+{
+	LARGE_INTEGER li;
+
+	if(!m_seekable) return 0;
+	li.QuadPart=(LONGLONG)pos;
+	if(!SetFilePointerEx(m_fh,li,NULL,FILE_BEGIN)) return 0;
+	m_bufpos=m_buflen=0;
+	m_pos=pos;
+	return 1;
+}
+
+// Read the data (and then the crc) of a chunk that next_chunk() returned
+// TWPNG_PARSE_STREAM for, a piece at a time. If pcrc is not NULL, the crc is
+// updated with the bytes.
+// Returns the number of bytes read, or -1 if there was a read error.
+int ChunkParser::read_data(unsigned char *buf, DWORD len, DWORD *pcrc)
+{
+	return read(buf,len,pcrc);
+}
+
+// Returns 1 if all 8 bytes were read.
+int ChunkParser::read_signature(unsigned char *sig)
+{
+	return (read(sig,8,NULL)==8);
+}
+
+// Read the next chunk into c: its length, type, stored crc, and data.
+// The crc of the type and data is calculated as they are read, and returned
+// in *pcrc. If it isn't calculated (see the TWPNG_PF_* flags),
+// c->m_crc_unverified is set instead.
+// If TWPNG_PF_DEFER is set, and the input is seekable, the data of image
+// data chunks is skipped over instead of being read. If TWPNG_PF_STREAMIMAGE
+// is set, it's left for the caller to read with read_data().
+// Returns a TWPNG_PARSE_* code. m_chunkpos is the file position of the chunk.
+int ChunkParser::next_chunk(Chunk *c, unsigned int flags, DWORD *pcrc)
+{
+	unsigned char fbuf[8];
+	DWORD ccrc;
+	int r;
+	int i;
+	int nocrc=0;
+
+	m_chunkpos=m_pos;
+
+	// first 4 bytes are the chunk data length,
+	// next 4 bytes are the chunk type
+	r=read(fbuf,8,NULL);
+	if(r<0) return TWPNG_PARSE_READERR;
+	if(r==0) return TWPNG_PARSE_END;  // this is normal; we've reached the end of file
+	if(r!=8) return TWPNG_PARSE_TRUNCATED;
+
+	c->length= read_int32(&fbuf[0]);
+
+	memcpy(c->m_chunktype_ascii,&fbuf[4],4);
+	c->m_chunktype_ascii[4]='\0';  // null-terminate for convenience
+	for(i=0;i<4;i++) {
+		if( !((c->m_chunktype_ascii[i]>='a' && c->m_chunktype_ascii[i]<='z') ||
+			(c->m_chunktype_ascii[i]>='A' && c->m_chunktype_ascii[i]<='Z')))
+		{
+			return TWPNG_PARSE_BADTYPE;
+		}
+	}
+	c->set_chunktype_tchar_from_ascii();
+
+	if(flags & TWPNG_PF_STOPATIMAGE) {
+		switch(c->get_chunk_type_id()) {
+		case CHUNK_IDAT: case CHUNK_JDAT: case CHUNK_IEND:
+			return TWPNG_PARSE_IMAGE;
+		}
+	}
+
+	if(c->length>0) {
+		// A sanity test for the chunk length.
+		if(c->length > TWPNG_MAX_CHUNK_LENGTH) return TWPNG_PARSE_BADLENGTH;
+		if(m_size_known && (ULONGLONG)c->length > m_size - m_chunkpos - 12)
+			return TWPNG_PARSE_BADLENGTH;
+
+		if(flags & TWPNG_PF_STREAMIMAGE) {
+			switch(c->get_chunk_type_id()) {
+			case CHUNK_IDAT: case CHUNK_JDAT: case CHUNK_fdAT:
+				return TWPNG_PARSE_STREAM;
+			}
+		}
+
+		if((flags & TWPNG_PF_DEFER) && m_seekable) {
+			switch(c->get_chunk_type_id()) {
+			case CHUNK_IDAT: case CHUNK_JDAT: case CHUNK_fdAT:
+				c->m_data_deferred = 1;
+				c->m_srcpos = m_chunkpos + 8;
+				break;
+			}
+		}
+	}
+
+	if(c->m_data_deferred) {
+		// If the size is known, the length was sanity-checked above, so
+		// this won't go past the end of the file.
+		if(!skip(c->length)) return TWPNG_PARSE_TRUNCATED;
+	}
+	else {
+		if(c->length>0) {
+			c->data = (unsigned char*)malloc(c->length);
+			if(!c->data) return TWPNG_PARSE_NOMEM;
+		}
+
+		nocrc = (flags & TWPNG_PF_NOCRC) ||
+			((flags & TWPNG_PF_NOLARGECRC) && c->length>=TWPNG_ASYNC_CRC_MIN);
+		if(nocrc) {
+			r=read(c->data,c->length,NULL);
+		}
+		else {
+			ccrc=update_crc(CRCINIT,(unsigned char*)c->m_chunktype_ascii,4);
+			r=read(c->data,c->length,&ccrc);
+			*pcrc=CRCCOMPL(ccrc);
+		}
+		if(r<0) return TWPNG_PARSE_READERR;
+		if((DWORD)r!=c->length) return TWPNG_PARSE_TRUNCATED;
+	}
+
+	// now read the CRC
+	r=read(fbuf,4,NULL);
+	if(r<0) return TWPNG_PARSE_READERR;
+	if(r!=4) return TWPNG_PARSE_TRUNCATED;
+
+	c->m_crc = read_int32(&fbuf[0]);
+	if(c->m_data_deferred || nocrc) {
+		c->m_crc_unverified = 1;
+	}
+	return TWPNG_PARSE_CHUNK;
+}
+
+// CrcPool checks the crcs of chunks as they're loaded, using the system
+// thread pool for the large ones, so that it overlaps with reading the
+// file. The results are reported in the order the chunks were added.
+
+struct crc_pool_item {
+	CrcPool *pool;
+	Chunk *c;
+	DWORD ccrc;  // calculated crc
+};
+
+CrcPool::CrcPool()
+{
+	m_items=NULL;
+	m_num_items=0;
+	m_items_alloc=0;
+	m_pending=1;  // this is our own reference, released by finish()
+	m_batch_len=0;
+	m_done_event=CreateEvent(NULL,TRUE,FALSE,NULL);
+}
+
+CrcPool::~CrcPool()
+{
+	int i;
+
+	finish();
+	for(i=0;i<m_num_items;i++) {
+		free(m_items[i]);
+	}
+	if(m_items) free(m_items);
+	if(m_done_event) CloseHandle(m_done_event);
+}
+
+DWORD WINAPI CrcPool::work_fn(LPVOID param)
+{
+	struct crc_pool_item *item = (struct crc_pool_item*)param;
+
+	item->ccrc = item->c->calc_crc();
+	if(InterlockedDecrement(&item->pool->m_pending)==0) {
+		SetEvent(item->pool->m_done_event);
+	}
+	return 0;
+}
+
+struct crc_pool_item *CrcPool::new_item(Chunk *c)
+{
+	struct crc_pool_item *item;
+	struct crc_pool_item **newitems;
+
+	if(m_num_items>=m_items_alloc) {
+		newitems=(struct crc_pool_item**)realloc((void*)m_items,
+			(m_items_alloc+200)*sizeof(struct crc_pool_item*));
+		if(!newitems) return NULL;
+		m_items=newitems;
+		m_items_alloc+=200;
+	}
+	item=(struct crc_pool_item*)malloc(sizeof(struct crc_pool_item));
+	if(!item) return NULL;
+	item->pool=this;
+	item->c=c;
+	item->ccrc=0;
+	m_items[m_num_items++]=item;
+	return item;
+}
+
+// Calculate c's crc in the background. Small chunks are saved up, and
+// done several at a time, on this thread.
+void CrcPool::add(Chunk *c)
+{
+	struct crc_pool_item *item;
+
+	item=new_item(c);
+	if(!item) {
+		c->verify_crc();  // do it the slow way
+		return;
+	}
+
+	if(c->length<TWPNG_ASYNC_CRC_MIN && !c->m_data_deferred) {
+		m_batch[m_batch_len++]=item;
+		if(m_batch_len>=TWPNG_CRC_BATCH) flush_batch();
+		return;
+	}
+
+	if(m_done_event) {
+		InterlockedIncrement(&m_pending);
+		if(QueueUserWorkItem(work_fn,(PVOID)item,WT_EXECUTEDEFAULT)) return;
+		InterlockedDecrement(&m_pending);
+	}
+	item->ccrc=c->calc_crc();
+}
+
+// Record a crc that the caller has already calculated.
+void CrcPool::add_result(Chunk *c, DWORD ccrc)
+{
+	struct crc_pool_item *item;
+
+	item=new_item(c);
+	if(!item) {
+		c->check_crc(ccrc);
+		return;
+	}
+	item->ccrc=ccrc;
+}
+
+void CrcPool::flush_batch()
+{
+	Chunk *chunks[TWPNG_CRC_BATCH];
+	DWORD crcs[TWPNG_CRC_BATCH];
+	int i;
+
+	for(i=0;i<m_batch_len;i++) {
+		chunks[i]=m_batch[i]->c;
+	}
+	calc_chunk_crcs(chunks,m_batch_len,crcs);
+	for(i=0;i<m_batch_len;i++) {
+		m_batch[i]->ccrc=crcs[i];
+	}
+	m_batch_len=0;
+}
+
+// Wait for all the crcs to be calculated, then check them against the
+// stored crcs (and warn about any that are wrong), in order.
+void CrcPool::finish()
+{
+	int i;
+
+	flush_batch();
+
+	if(m_pending>0) {
+		if(InterlockedDecrement(&m_pending)>0) {
+			WaitForSingleObject(m_done_event,INFINITE);
+		}
+	}
+
+	for(i=0;i<m_num_items;i++) {
+		if(m_items[i]->c) m_items[i]->c->check_crc(m_items[i]->ccrc);
+		m_items[i]->c=NULL;
+	}
+}
+
+int Png::read_signature(ChunkParser *p)
+{
+	if(!p->read_signature(signature)) return 0;
+	if(!memcmp(signature,sig_png,8)) return IMG_PNG;
+	if(!memcmp(signature,sig_mng,8)) return IMG_MNG;
+	if(!memcmp(signature,sig_jng,8)) return IMG_JNG;
+	return IMG_UNKNOWN;
+}
+
+// pflags is TWPNG_PF_DEFER and/or TWPNG_PF_STOPATIMAGE. With TWPNG_PF_DEFER,
+// the data of image data chunks is skipped over, and will be read from
+// m_srcfh when it's needed.
+// The crc is checked by crcpool, which has to be finish()ed after the last
+// chunk has been read.
+int Png::read_next_chunk(ChunkParser *p, unsigned int pflags, CrcPool *crcpool)
+{
+	Chunk *c;
+	DWORD ccrc=0;
+	int r;
+
+	// allocate a Chunk structure for this new chunk
+	c = new Chunk();
+
+	c->m_parentpng = this;  // chunks sometimes depend other chunks, ...
+
+	r=p->next_chunk(c,TWPNG_PF_NOCRC|pflags,&ccrc);
+
+	switch(r) {
+	case TWPNG_PARSE_CHUNK:
+		break;
+	case TWPNG_PARSE_END:
+		break;
+	case TWPNG_PARSE_IMAGE:
+		m_partial=1;
+		break;
+	case TWPNG_PARSE_BADTYPE:
+		mesg(MSG_W,_T("Invalid chunk type found at file position %I64u. ")
+			_T("This may indicate garbage at the end of the file."),p->m_chunkpos);
+		break;
+	case TWPNG_PARSE_BADLENGTH:
+		mesg(MSG_W,_T("Bogus chunk length found. This may indicate garbage at the end of the file."));
+		break;
+	case TWPNG_PARSE_NOMEM:
+		mesg(MSG_S,_T("Can") SYM_RSQUO _T("t allocate memory for chunk"));
+		break;
+	case TWPNG_PARSE_READERR:
+		mesg(MSG_W,_T("Error reading file"));
+		break;
+	default:  // TWPNG_PARSE_TRUNCATED
+		mesg(MSG_W,_T("Garbage found at end of file"));
+		break;
+	}
+	if(r!=TWPNG_PARSE_CHUNK) {
+		delete c;
+		return 0;
+	}
+
+	c->m_filepos=p->m_chunkpos;
+	c->m_filecrc=c->m_crc;
+
+	// check the crc
+	if(c->m_data_deferred)
+		;  // checked when the data is read, or by verify_crcs()
+	else if(c->m_crc_unverified)
+		crcpool->add(c);
+	else
+		crcpool->add_result(c,ccrc);
+
+	init_new_chunk(m_num_chunks);  // make sure chunks array is large enough
+	chunk[m_num_chunks++]=c;
+
+	c->after_init();
+
+	return 1;
+}
+
+// Create a read-only view of the whole file, for TWPNG_LOAD_MAPPED.
+// Returns 0 if the file can't be mapped, in which case the caller should
+// just read it the normal way.
+int Png::map_file(HANDLE fh)
+{
+	if(m_pngfilesize > (ULONGLONG)(SIZE_T)(-1)) return 0;  // too big for our address space
+	if(m_pngfilesize<8) return 0;
+
+	m_srcmapping=CreateFileMapping(fh,NULL,PAGE_READONLY,0,0,NULL);
+	if(!m_srcmapping) return 0;
+
+	m_srcview=(unsigned char*)MapViewOfFile(m_srcmapping,FILE_MAP_READ,0,0,0);
+	if(!m_srcview) {
+		// Most likely, there wasn't enough contiguous address space.
+		CloseHandle(m_srcmapping);
+		m_srcmapping=NULL;
+		return 0;
+	}
+	return 1;
+}
+
+// Find the next position at or after p (and before end-3) where there are
+// four consecutive ASCII letters, which could be a chunk type.
+// Returns NULL if there isn't one.
+static const unsigned char *find_chunk_type_candidate(const unsigned char *p,
+	const unsigned char *end)
+{
+	int i;
+
+#ifdef TWPNG_USE_SSE2
+	static int have_sse2 = -1;
+	__m128i v, adj, lim;
+	unsigned int m;
+
+	if(have_sse2<0) {
+#ifdef _M_X64
+		have_sse2 = 1;
+#else
+		have_sse2 = IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) ? 1 : 0;
+#endif
+	}
+
+	if(have_sse2) {
+		// Look at 16 bytes at a time. A byte is a letter if (b|0x20) is in
+		// 'a'..'z'; shifting that range to the bottom of the signed range
+		// lets one signed compare test it. Blocks overlap by 3 bytes, so
+		// that a run of 4 letters can't be missed.
+		adj = _mm_set1_epi8((char)(0x80-'a'));
+		lim = _mm_set1_epi8((char)(0x80+26));
+		while(end-p >= 16) {
+			v = _mm_loadu_si128((const __m128i*)p);
+			v = _mm_or_si128(v,_mm_set1_epi8(0x20));
+			v = _mm_add_epi8(v,adj);
+			m = (unsigned int)_mm_movemask_epi8(_mm_cmplt_epi8(v,lim));
+			m = m & (m>>1) & (m>>2) & (m>>3) & 0x1fff;
+			if(m) {
+				for(i=0; !(m&1); i++) m>>=1;
+				return p+i;
+			}
+			p += 13;
+		}
+	}
+#endif
+
+	for( ; end-p >= 4; p++) {
+		for(i=0;i<4;i++) {
+			if(!((p[i]>='a' && p[i]<='z') || (p[i]>='A' && p[i]<='Z'))) break;
+		}
+		if(i==4) return p;
+	}
+	return NULL;
+}
+
+// Check whether a plausible chunk starts at position pos in m_srcview.
+// Returns a TWPNG_PARSE_* code.
+int Png::check_mapped_chunk(ULONGLONG pos)
+{
+	unsigned char *p;
+	ULONGLONG avail;
+	DWORD length;
+	int i;
+
+	if(pos>=m_pngfilesize) return TWPNG_PARSE_END;  // normal end of file
+
+	avail = m_pngfilesize - pos;
+	if(avail<8) return TWPNG_PARSE_TRUNCATED;
+
+	p = &m_srcview[(size_t)pos];
+	for(i=4;i<8;i++) {
+		if(!((p[i]>='a' && p[i]<='z') || (p[i]>='A' && p[i]<='Z')))
+			return TWPNG_PARSE_BADTYPE;
+	}
+
+	length = read_int32(&p[0]);
+	if(length>TWPNG_MAX_CHUNK_LENGTH) return TWPNG_PARSE_BADLENGTH;
+	if((ULONGLONG)length+12 > avail) {
+		// (Same distinction as read_next_chunk() makes.)
+		return (length>0) ? TWPNG_PARSE_BADLENGTH : TWPNG_PARSE_TRUNCATED;
+	}
+	return TWPNG_PARSE_CHUNK;
+}
+
+// For TWPNG_LOAD_RECOVER. Starting just after pos, look for the next
+// place where there's a chunk with a valid type, length, and crc.
+// Returns its position, or m_pngfilesize if there isn't one.
+ULONGLONG Png::resync_mapped(ULONGLONG pos)
+{
+	const unsigned char *q;
+	const unsigned char *end;
+	unsigned char *p;
+	ULONGLONG chunkpos;
+	ULONGLONG nextpos;
+	DWORD length;
+	DWORD ccrc;
+
+	end = &m_srcview[(size_t)m_pngfilesize];
+	if(m_pngfilesize - pos < 13) return m_pngfilesize;
+	q = &m_srcview[(size_t)pos+5];  // the type field of a chunk at pos+1
+
+	while(1) {
+		q = find_chunk_type_candidate(q,end);
+		if(!q) return m_pngfilesize;
+
+		chunkpos = (ULONGLONG)(q - m_srcview) - 4;
+		if(check_mapped_chunk(chunkpos)==TWPNG_PARSE_CHUNK) {
+			p = &m_srcview[(size_t)chunkpos];
+			length = read_int32(&p[0]);
+
+			// Most candidates in damaged or compressed data can be ruled
+			// out without reading the whole chunk: a real chunk is
+			// followed by the end of the file or another chunk header.
+			// Only small chunks are checked without that, in case the
+			// damage continues right after one.
+			nextpos = chunkpos+12+length;
+			if(nextpos!=m_pngfilesize && length>TWPNG_RESYNC_UNLINKED_MAX &&
+				check_mapped_chunk(nextpos)!=TWPNG_PARSE_CHUNK)
+			{
+				q++;
+				continue;
+			}
+
+			ccrc = update_crc(CRCINIT,&p[4],4);
+			ccrc = update_crc(ccrc,&p[8],length);
+			if(CRCCOMPL(ccrc) == read_int32(&p[8+length])) return chunkpos;
+		}
+		q++;
+	}
+}
+
+// Remember a damaged region that was skipped, for report_recovery().
+void Png::add_skipped_range(ULONGLONG pos, ULONGLONG len)
+{
+	struct twpng_skipped_range *newranges;
+
+	if(m_num_skipped>=m_skipped_alloc) {
+		newranges=(struct twpng_skipped_range*)realloc((void*)m_skipped,
+			(m_skipped_alloc+20)*sizeof(struct twpng_skipped_range));
+		if(!newranges) return;
+		m_skipped=newranges;
+		m_skipped_alloc+=20;
+	}
+	m_skipped[m_num_skipped].pos = pos;
+	m_skipped[m_num_skipped].len = len;
+	m_skipped[m_num_skipped].next_chunk = m_num_chunks;
+	m_num_skipped++;
+}
+
+// Tell the user what TWPNG_LOAD_RECOVER did.
+void Png::report_recovery()
+{
+	TCHAR buf[2048];
+	TCHAR line[200];
+	int i;
+
+	if(m_num_skipped<1) {
+		mesg(MSG_I,_T("No damaged areas were found."));
+		return;
+	}
+
+	StringCchPrintf(buf,2048,
+		_T("Skipped %d damaged area(s), and recovered %d chunk(s) after them.\n"),
+		m_num_skipped, m_num_chunks - m_skipped[0].next_chunk);
+
+	for(i=0;i<m_num_skipped && i<20;i++) {
+		if(m_skipped[i].next_chunk < m_num_chunks) {
+			StringCchPrintf(line,200,
+				_T("\nBytes %I64u") SYM_ENDASH _T("%I64u skipped; resumed at chunk #%d (%s)"),
+				m_skipped[i].pos, m_skipped[i].pos + m_skipped[i].len - 1,
+				m_skipped[i].next_chunk+1, chunk[m_skipped[i].next_chunk]->m_chunktype_tchar);
+		}
+		else {
+			StringCchPrintf(line,200,
+				_T("\nBytes %I64u") SYM_ENDASH _T("%I64u skipped; no chunks found after them"),
+				m_skipped[i].pos, m_skipped[i].pos + m_skipped[i].len - 1);
+		}
+		StringCchCat(buf,2048,line);
+	}
+	if(m_num_skipped>20) {
+		StringCchCat(buf,2048,_T("\n..."));
+	}
+	mesg(MSG_W,_T("%s"),buf);
+}
+
+// Like read_next_chunk(), but the chunk's data is not copied; it points
+// into m_srcview until the chunk is modified.
+// If recover is set, damaged areas are skipped over instead of ending the
+// file.
+int Png::read_next_chunk_mapped(ULONGLONG *filepos, int recover, CrcPool *crcpool)
+{
+	Chunk *c;
+	unsigned char *p;
+	ULONGLONG newpos;
+	int r;
+
+	r=check_mapped_chunk(*filepos);
+
+	if(recover && r!=TWPNG_PARSE_CHUNK && r!=TWPNG_PARSE_END) {
+		newpos=resync_mapped(*filepos);
+		add_skipped_range(*filepos,newpos-*filepos);
+		*filepos=newpos;
+		r=check_mapped_chunk(*filepos);
+	}
+
+	switch(r) {
+	case TWPNG_PARSE_CHUNK:
+	case TWPNG_PARSE_END:
+		break;
+	case TWPNG_PARSE_BADTYPE:
+		mesg(MSG_W,_T("Invalid chunk type found at file position %I64u. ")
+			_T("This may indicate garbage at the end of the file."),*filepos);
+		break;
+	case TWPNG_PARSE_BADLENGTH:
+		mesg(MSG_W,_T("Bogus chunk length found. This may indicate garbage at the end of the file."));
+		break;
+	default:
+		mesg(MSG_W,_T("Garbage found at end of file"));
+		break;
+	}
+	if(r!=TWPNG_PARSE_CHUNK) return 0;
+
+	p = &m_srcview[(size_t)*filepos];
+
+	c = new Chunk();
+
+	c->m_parentpng = this;
+
+	c->length= read_int32(&p[0]);
+
+	memcpy(c->m_chunktype_ascii,&p[4],4);
+	c->m_chunktype_ascii[4]='\0';
+	c->set_chunktype_tchar_from_ascii();
+
+	if(c->length>0) {
+		c->data = &p[8];
+		c->m_data_mapped = 1;
+	}
+
+	c->m_crc = read_int32(&p[8+c->length]);
+
+	c->m_crc_unverified = 1;
+
+	c->m_filepos=*filepos;
+	c->m_filecrc=c->m_crc;
+
+	init_new_chunk(m_num_chunks);
+	chunk[m_num_chunks++]=c;
+
+	// Large chunks are left for verify_crcs(), so that we don't have to
+	// page in the whole file just to open it.
+	if(c->length < TWPNG_MAPPED_CRC_LIMIT) {
+		crcpool->add(c);
+	}
+
+	c->after_init();
+
+	*filepos += c->length + 12;
+	return 1;
+}
+
+// Check the crc of any chunks that weren't checked when the file was loaded.
+// If in_place is set, chunks that are unchanged and still in their place in
+// the layout file are skipped, since saving in place doesn't touch them.
+// Returns the number of crcs that were wrong (and have been corrected).
+int Png::verify_crcs(int in_place)
+{
+	Chunk *c;
+	ULONGLONG pos;
+	int skip;
+	int i;
+	int nbad=0;
+	DWORD oldcrc;
+
+	pos=8;
+	for(i=0;i<m_num_chunks;i++) {
+		c=chunk[i];
+		skip = !c->m_crc_unverified || (in_place && c->m_filepos==pos &&
+			c->m_crc==c->m_filecrc && !c->m_file_stale);
+		pos += 12+(ULONGLONG)c->length;
+		if(skip) continue;
+
+		oldcrc=c->m_crc;
+		c->verify_crc();
+		if(c->m_crc != oldcrc) {
+			nbad++;
+			if(this==png && globals.hwndMainList) update_row(globals.hwndMainList,i);
+		}
+	}
+	return nbad;
+}
+
+// Make private copies of any chunk data that is still in the file view,
+// or hasn't been read yet, and close the source file.
+// Returns 0 on failure (probably out of memory), in which case the source
+// file is left open.
+int Png::release_source_file()
+{
+	int i;
+
+	if(!m_srcview && m_srcfh==INVALID_HANDLE_VALUE) return 1;
+
+	for(i=0;i<m_num_chunks;i++) {
+		if(!chunk[i]->make_data_private()) return 0;
+	}
+
+	if(m_srcview) {
+		UnmapViewOfFile(m_srcview);
+		m_srcview=NULL;
+		CloseHandle(m_srcmapping);
+		m_srcmapping=NULL;
+	}
+	if(m_srcfh!=INVALID_HANDLE_VALUE) {
+		CloseHandle(m_srcfh);
+		m_srcfh=INVALID_HANDLE_VALUE;
+	}
+	return 1;
+}
+
+// Read exactly len bytes at position pos in a file.
+static int read_file_at(HANDLE fh, ULONGLONG pos, unsigned char *buf, DWORD len)
+{
+	LARGE_INTEGER li;
+	DWORD n;
+
+	li.QuadPart = (LONGLONG)pos;
+	if(!SetFilePointerEx(fh,li,NULL,FILE_BEGIN)) return 0;
+	if(!ReadFile(fh,(LPVOID)buf,len,&n,NULL) || n!=len) return 0;
+	return 1;
+}
+
+// Read len bytes at position pos in the source file (for chunks whose data
+// was deferred by TWPNG_LOAD_LAZY).
+int Png::read_source(ULONGLONG pos, unsigned char *buf, DWORD len)
+{
+	if(m_srcfh==INVALID_HANDLE_VALUE) return 0;
+
+	if(!read_file_at(m_srcfh,pos,buf,len)) {
+		mesg(MSG_E,_T("Can") SYM_RSQUO _T("t read from file (%s)"),m_srcfilename);
+		return 0;
+	}
+	return 1;
+}
+
+// Bring the document up to date after another program has changed its file.
+// Chunks that are still at the same position in the file, with the same
+// length, type, and crc, are kept. Only the chunk headers and crcs are read
+// to check that, so this takes time in proportion to the number of chunks,
+// not the size of the file. Everything from the first chunk that doesn't
+// match to the end of the file is read again.
+// This only works if the document hasn't been modified since it was last
+// loaded or saved, because it assumes the file's layout matches ours.
+// *pnum_kept is set to the number of chunks that were kept.
+// Returns a TWPNG_REFRESH_* code. After TWPNG_REFRESH_FAILED, the document
+// may be incomplete.
+int Png::refresh(int *pnum_kept)
+{
+	HANDLE fh;
+	LARGE_INTEGER filesize;
+	ChunkParser *parser;
+	CrcPool *crcpool;
+	unsigned char buf[8];
+	ULONGLONG pos;
+	ULONGLONG size;
+	int kept;
+	int i;
+
+	*pnum_kept=0;
+
+	// If damaged areas were skipped, our layout doesn't match the file.
+	if(!m_named || m_dirty || m_partial || m_num_skipped>0) return TWPNG_REFRESH_FAILED;
+
+	fh=CreateFile(m_filename,GENERIC_READ,FILE_SHARE_READ|FILE_SHARE_WRITE,NULL,
+		OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+	if(fh==INVALID_HANDLE_VALUE) {
+		if(GetLastError()==ERROR_SHARING_VIOLATION) return TWPNG_REFRESH_BUSY;
+		return TWPNG_REFRESH_FAILED;
+	}
+	if(!GetFileSizeEx(fh,&filesize)) {
+		CloseHandle(fh);
+		return TWPNG_REFRESH_FAILED;
+	}
+	size=(ULONGLONG)filesize.QuadPart;
+
+	if(!read_file_at(fh,0,buf,8) || memcmp(buf,signature,8)) {
+		CloseHandle(fh);
+		return TWPNG_REFRESH_FAILED;
+	}
+
+	// Find the first chunk that has changed.
+	pos=8;
+	for(kept=0;kept<m_num_chunks;kept++) {
+		if(pos+12+(ULONGLONG)chunk[kept]->length > size) break;
+		if(!read_file_at(fh,pos,buf,8)) break;
+		if(read_int32(&buf[0])!=chunk[kept]->length) break;
+		if(memcmp(&buf[4],chunk[kept]->m_chunktype_ascii,4)) break;
+		if(!read_file_at(fh,pos+8+chunk[kept]->length,buf,4)) break;
+		if(read_int32(&buf[0])!=chunk[kept]->m_crc) break;
+		pos += 12+(ULONGLONG)chunk[kept]->length;
+	}
+
+	parser=new ChunkParser(fh,size);
+	if(!parser->seek(pos)) {
+		delete parser;
+		CloseHandle(fh);
+		return TWPNG_REFRESH_FAILED;
+	}
+
+	for(i=kept;i<m_num_chunks;i++) {
+		delete chunk[i];
+		chunk[i]=NULL;
+	}
+	m_num_chunks=kept;
+	m_pngfilesize=size;
+
+	// New chunks are always read into memory, because any data that is
+	// still deferred is read from the old file handle.
+	crcpool=new CrcPool();
+	while(read_next_chunk(parser,0,crcpool))
+		;
+	crcpool->finish();
+	delete crcpool;
+	delete parser;
+	CloseHandle(fh);
+
+	// The chunks' m_filepos values now refer to this file, as it is now.
+	if(!GetFullPathName(m_filename,MAX_PATH,m_layoutfilename,NULL) ||
+		!get_file_stamp(m_layoutfilename,&m_layoutsize,&m_layouttime))
+	{
+		StringCchCopy(m_layoutfilename,MAX_PATH,_T(""));
+	}
+
+	*pnum_kept=kept;
+	return TWPNG_REFRESH_OK;
+}
+
+// Initialization shared by all the constructors. The document is empty,
+// untitled, and not tied to any file.
+void Png::init_members()
+{
+	m_num_chunks=0;
+	chunk=NULL;
+	m_chunks_alloc=0;
+	m_srcfh=INVALID_HANDLE_VALUE;
+	m_srcmapping=NULL;
+	m_srcview=NULL;
+	m_skipped=NULL;
+	m_num_skipped=0;
+	m_skipped_alloc=0;
+	StringCchCopy(m_layoutfilename,MAX_PATH,_T(""));
+	m_layoutsize=0;
+	m_stream_view=NULL;
+	m_pngfilesize=0;  // unknown
+	StringCchCopy(m_filename,MAX_PATH,_T("untitled"));
+	m_named=0;
+	m_dirty=0;
+	m_partial=0;
+
+	chunk=(Chunk**)malloc(200*sizeof(Chunk*));
+	m_chunks_alloc=200;
+}
+
+Png::Png()
+{
+	init_members();
+	m_imgtype=IMG_PNG;
+
+	m_width=1;
+	m_height=1;
+	m_bitdepth=1;
 	m_colortype=0;
 	//m_compression=0;
 	//m_compressionfilter=0;
@@ -886,23 +2415,22 @@ Png::Png()
 // support for running "filter" utilities. A filter will accept a
 // (temporary) PNG file, and write a new (temporary) PNG file, which
 // we will read as a replacement for the original file.
-Png::Png(const TCHAR *load_fn, const TCHAR *save_fn)
+Png::Png(const TCHAR *load_fn, const TCHAR *save_fn, unsigned int loadflags)
 {
 	int okay;
+	int i;
 	HANDLE fh;
-	DWORD filepos;
+	ChunkParser *parser;
+	CrcPool *crcpool;
+	ULONGLONG filepos;
+	LARGE_INTEGER filesize;
+	unsigned int pflags;
 
 	m_valid=0;
 
-	m_num_chunks=0;
-	chunk=NULL;
-	m_chunks_alloc=0;
+	init_members();
 	StringCchCopy(m_filename,MAX_PATH,save_fn);
 	m_named=1;
-	m_dirty=0;
-
-	chunk=(Chunk**)malloc(200*sizeof(Chunk*));
-	m_chunks_alloc=200;
 
 	m_colortype=255;  // random invalid value
 
@@ -913,12 +2441,28 @@ Png::Png(const TCHAR *load_fn, const TCHAR *save_fn)
 		return;
 	}
 
-	m_pngfilesize=GetFileSize(fh,NULL);  // note, this will fail for files over 4 GB
+	if(!GetFileSizeEx(fh,&filesize)) {
+		CloseHandle(fh);
+		mesg(MSG_E,_T("Can") SYM_RSQUO _T("t get size of file (%s)"),load_fn);
+		return;
+	}
+	m_pngfilesize=(ULONGLONG)filesize.QuadPart;
+
+	if(loadflags & TWPNG_LOAD_PROBE) {
+		// There's nothing to gain from mapping the file, and nothing
+		// to recover.
+		loadflags &= ~(TWPNG_LOAD_MAPPED|TWPNG_LOAD_RECOVER);
+		parser=new ChunkParser(fh,m_pngfilesize,TWPNG_PROBE_BUFSIZE);
+	}
+	else {
+		parser=new ChunkParser(fh,m_pngfilesize);
+	}
 
-	m_imgtype=read_signature(fh);
+	m_imgtype=read_signature(parser);
 	okay=(m_imgtype>=1);
 
 	if(!okay) {
+		delete parser;
 		CloseHandle(fh);
 		SetForegroundWindow(globals.hwndMain);
 		mesg(MSG_E,_T("Unrecognized file format\n\nThis is not a valid PNG file."));
@@ -927,11 +2471,94 @@ Png::Png(const TCHAR *load_fn, const TCHAR *save_fn)
 
 	filepos = 8;
 
+	// We need to know the file's full name so that we can tell if we're
+	// about to overwrite it.
+	if(loadflags & (TWPNG_LOAD_MAPPED|TWPNG_LOAD_LAZY|TWPNG_LOAD_RECOVER)) {
+		if(!GetFullPathName(load_fn,MAX_PATH,m_srcfilename,NULL))
+			loadflags=0;
+	}
+
+	if(loadflags & (TWPNG_LOAD_MAPPED|TWPNG_LOAD_RECOVER)) {
+		map_file(fh); // If this fails, we'll read the file instead.
+		if(!m_srcview && (loadflags & TWPNG_LOAD_RECOVER)) {
+			mesg(MSG_W,_T("Can") SYM_RSQUO _T("t map this file into memory, so damaged areas can") SYM_RSQUO _T("t be skipped."));
+			loadflags &= ~TWPNG_LOAD_RECOVER;
+		}
+	}
+
+	pflags=0;
+	if(loadflags & TWPNG_LOAD_LAZY) pflags |= TWPNG_PF_DEFER;
+	if(loadflags & TWPNG_LOAD_PROBE) pflags |= TWPNG_PF_STOPATIMAGE;
+
+	crcpool=new CrcPool();
 	while(okay) {
-		okay=read_next_chunk(fh,&filepos);
+		if(m_srcview)
+			okay=read_next_chunk_mapped(&filepos,(loadflags & TWPNG_LOAD_RECOVER)?1:0,crcpool);
+		else
+			okay=read_next_chunk(parser,pflags,crcpool);
 	}
+	crcpool->finish();
+	delete crcpool;
+	delete parser;
 
-	CloseHandle(fh);
+	if(loadflags & TWPNG_LOAD_RECOVER) {
+		report_recovery();
+	}
+
+	// If any chunks still have data in the file, keep it open.
+	// (The mapping, if any, stays valid after the file handle is closed.)
+	for(i=0;i<m_num_chunks;i++) {
+		if(chunk[i]->m_data_deferred) {
+			m_srcfh=fh;
+			fh=INVALID_HANDLE_VALUE;
+			break;
+		}
+	}
+	if(fh!=INVALID_HANDLE_VALUE) CloseHandle(fh);
+
+	// Remember where the chunks are, so that saving over this file can
+	// skip the ones that haven't changed.
+	if(!GetFullPathName(load_fn,MAX_PATH,m_layoutfilename,NULL) ||
+		!get_file_stamp(m_layoutfilename,&m_layoutsize,&m_layouttime))
+	{
+		StringCchCopy(m_layoutfilename,MAX_PATH,_T(""));
+	}
+	m_valid=1;
+}
+
+// Load from a source that can only be read in order, such as a pipe.
+// The new Png is unnamed.
+Png::Png(twpng_read_cb_type read_fn, void *userdata)
+{
+	int okay;
+	ChunkParser *parser;
+	CrcPool *crcpool;
+
+	m_valid=0;
+
+	init_members();
+
+	m_colortype=255;  // random invalid value
+
+	parser=new ChunkParser(read_fn,userdata);
+
+	m_imgtype=read_signature(parser);
+	okay=(m_imgtype>=1);
+
+	if(!okay) {
+		delete parser;
+		SetForegroundWindow(globals.hwndMain);
+		mesg(MSG_E,_T("Unrecognized file format\n\nThis is not a valid PNG file."));
+		return;
+	}
+
+	crcpool=new CrcPool();
+	while(okay) {
+		okay=read_next_chunk(parser,0,crcpool);
+	}
+	crcpool->finish();
+	delete crcpool;
+	delete parser;
 	m_valid=1;
 }
 
@@ -940,6 +2567,8 @@ Png::~Png()
 {
 	int i;
 
+	stream_file_end();
+
 	// free individual chunks
 	for(i=0;i<m_num_chunks;i++) {
 		if(chunk[i]) delete chunk[i];
@@ -947,6 +2576,12 @@ Png::~Png()
 
 	// free chunk list
 	if(chunk) free(chunk);
+	if(m_skipped) free(m_skipped);
+
+	// The chunks may have been pointing into this, so it has to go last.
+	if(m_srcview) UnmapViewOfFile(m_srcview);
+	if(m_srcmapping) CloseHandle(m_srcmapping);
+	if(m_srcfh!=INVALID_HANDLE_VALUE) CloseHandle(m_srcfh);
 }
 
 
@@ -1052,6 +2687,10 @@ static int SaveSettings()
 	r=RegSetValueEx(key,_T("use_imagebg"),0,REG_DWORD,(LPBYTE)&globals.use_imagebg,sizeof(DWORD));
 	r=RegSetValueEx(key,_T("windowbg"),0,REG_DWORD,(LPBYTE)&globals.window_bgcolor,sizeof(DWORD));
 	r=RegSetValueEx(key,_T("zoom"),0,REG_DWORD,(LPBYTE)&globals.vsize,sizeof(DWORD));
+	r=RegSetValueEx(key,_T("map_files"),0,REG_DWORD,(LPBYTE)&globals.map_files,sizeof(DWORD));
+	r=RegSetValueEx(key,_T("lazy_load"),0,REG_DWORD,(LPBYTE)&globals.lazy_load,sizeof(DWORD));
+	r=RegSetValueEx(key,_T("watch_file"),0,REG_DWORD,(LPBYTE)&globals.watch_file,sizeof(DWORD));
+	r=RegSetValueEx(key,_T("repair_crc"),0,REG_DWORD,(LPBYTE)&globals.repair_crc,sizeof(DWORD));
 
 	if(IsWindow(globals.hwndMainList)) {
 		for(i=0;i<5;i++) {
@@ -1067,112 +2706,493 @@ static int SaveSettings()
 	RegSetValueEx(key,_T("bgcolor"),0,REG_DWORD,(LPBYTE)&tmpd,sizeof(DWORD));
 	RegSetValueEx(key,_T("custcolors"),0,REG_BINARY,(LPBYTE)&globals.custcolors,16*sizeof(COLORREF));
 
-	RegCloseKey(key);
+	RegCloseKey(key);
+
+	return 1;
+}
+
+static void ReadSettings()
+{
+	HKEY key;
+	LONG r;
+	DWORD datasize,tmpd;
+	int i;
+	TCHAR v[24];
+	//prefs_t tmp_prefs;
+
+	globals.compression_level=Z_DEFAULT_COMPRESSION;
+	globals.use_gamma=1;
+	globals.custombgcolor = RGB(128,128,128);
+	globals.use_custombg = 1;
+	globals.use_imagebg = 1;
+	for(i=0;i<16;i++) globals.custcolors[i] = RGB(0,0,0);
+	globals.autoopen_viewer=0;
+	globals.map_files=0;
+	globals.lazy_load=0;
+	globals.watch_file=0;
+	globals.repair_crc=0;
+	globals.window_bgcolor=TWPNG_WBG_SAMEASIMAGE;
+
+	for(i=0;i<TWPNG_NUMTOOLS;i++) {
+		StringCchCopy(globals.tools[i].name,MAX_TOOL_NAME,_T(""));
+		StringCchCopy(globals.tools[i].cmd,MAX_TOOL_CMD,_T(""));
+		StringCchCopy(globals.tools[i].params,MAX_TOOL_PARAMS,_T(""));
+	}
+	StringCchCopy(globals.tools[0].name,MAX_TOOL_NAME,_T("Default viewer"));
+	globals.window_prefs.version = 1;
+	globals.window_prefs.column_width[0]=50;
+	globals.window_prefs.column_width[1]=60;
+	globals.window_prefs.column_width[2]=60;
+	globals.window_prefs.column_width[3]=130;
+	globals.window_prefs.column_width[4]=600;
+
+	globals.window_prefs.main.x=0;
+	globals.window_prefs.main.y=0;
+	globals.window_prefs.main.w=600;
+	globals.window_prefs.main.h=300;
+	globals.window_prefs.main.max=0;
+
+	globals.window_prefs.text.x=0;
+	globals.window_prefs.text.y=0;
+	globals.window_prefs.text.w=500;
+	globals.window_prefs.text.h=300;
+	globals.window_prefs.text.max=0;
+
+	globals.window_prefs.plte.x=0;
+	globals.window_prefs.plte.y=0;
+	globals.window_prefs.plte.w=490;
+	globals.window_prefs.plte.h=440;
+	globals.window_prefs.plte.max=0;
+
+	globals.window_prefs.viewer.x=0;
+	globals.window_prefs.viewer.y=100;
+	globals.window_prefs.viewer.w=350;
+	globals.window_prefs.viewer.h=250;
+	globals.window_prefs.viewer.max=0;
+
+	if(RegOpenKeyEx(HKEY_CURRENT_USER,globals.twpng_reg_key,0,KEY_READ,&key)
+		!= ERROR_SUCCESS) return;
+
+	for(i=0;i<TWPNG_NUMTOOLS;i++) {
+		StringCchPrintf(v,24,_T("tool%dn"),i); datasize= sizeof(TCHAR)*(MAX_TOOL_NAME-1);
+		r=RegQueryValueEx(key,v,NULL,NULL,(LPBYTE)globals.tools[i].name,&datasize);
+		globals.tools[i].name[MAX_TOOL_NAME-1]='\0';
+
+		StringCchPrintf(v,24,_T("tool%dc"),i); datasize= sizeof(TCHAR)*(MAX_TOOL_CMD-1);
+		r=RegQueryValueEx(key,v,NULL,NULL,(LPBYTE)globals.tools[i].cmd,&datasize);
+		globals.tools[i].cmd[MAX_TOOL_CMD-1]='\0';
+
+		StringCchPrintf(v,24,_T("tool%dp"),i); datasize= sizeof(TCHAR*)*(MAX_TOOL_PARAMS-1);
+		r=RegQueryValueEx(key,v,NULL,NULL,(LPBYTE)globals.tools[i].params,&datasize);
+		globals.tools[i].params[MAX_TOOL_PARAMS-1]='\0';
+	}
+
+	datasize=sizeof(globals.compression_level);
+	r=RegQueryValueEx(key,_T("deflate_lvl"),NULL,NULL,(LPBYTE)&globals.compression_level,&datasize);
+
+	datasize=sizeof(globals.window_prefs);
+	r=RegQueryValueEx(key,_T("windowpos"),NULL,NULL,(LPBYTE)(&globals.window_prefs),&datasize);
+
+	datasize=sizeof(DWORD);
+	r=RegQueryValueEx(key,_T("show_viewer"),NULL,NULL,(LPBYTE)(&globals.autoopen_viewer),&datasize);
+
+	datasize=sizeof(DWORD);
+	r=RegQueryValueEx(key,_T("use_gamma"),NULL,NULL,(LPBYTE)(&globals.use_gamma),&datasize);
+	datasize=sizeof(DWORD);
+	r=RegQueryValueEx(key,_T("use_custombg"),NULL,NULL,(LPBYTE)(&globals.use_custombg),&datasize);
+	datasize=sizeof(DWORD);
+	r=RegQueryValueEx(key,_T("use_imagebg"),NULL,NULL,(LPBYTE)(&globals.use_imagebg),&datasize);
+	datasize=sizeof(DWORD);
+	r=RegQueryValueEx(key,_T("windowbg"),NULL,NULL,(LPBYTE)(&globals.window_bgcolor),&datasize);
+	datasize=sizeof(DWORD);
+	r=RegQueryValueEx(key,_T("zoom"),NULL,NULL,(LPBYTE)(&globals.vsize),&datasize);
+	datasize=sizeof(DWORD);
+	r=RegQueryValueEx(key,_T("map_files"),NULL,NULL,(LPBYTE)(&globals.map_files),&datasize);
+	datasize=sizeof(DWORD);
+	r=RegQueryValueEx(key,_T("lazy_load"),NULL,NULL,(LPBYTE)(&globals.lazy_load),&datasize);
+	datasize=sizeof(DWORD);
+	r=RegQueryValueEx(key,_T("watch_file"),NULL,NULL,(LPBYTE)(&globals.watch_file),&datasize);
+	datasize=sizeof(DWORD);
+	r=RegQueryValueEx(key,_T("repair_crc"),NULL,NULL,(LPBYTE)(&globals.repair_crc),&datasize);
+
+	datasize=sizeof(DWORD);
+	r=RegQueryValueEx(key,_T("bgcolor"),NULL,NULL,(LPBYTE)&tmpd,&datasize);
+	if(r==ERROR_SUCCESS) {
+		globals.custombgcolor = (COLORREF)tmpd;
+	}
+
+	datasize = 16*sizeof(COLORREF);
+	r=RegQueryValueEx(key,_T("custcolors"),NULL,NULL,(LPBYTE)(&globals.custcolors),&datasize);
+	RegCloseKey(key);
+}
+
+// "-crctest [file]" and "-iotest [file]" run a self-test and benchmark,
+// without opening a window. test_fn is given the name of the results file.
+// Returns 1 if that was the command line, and sets *pret to the process
+// exit code.
+static int run_cmdline_selftest(const TCHAR *lpCmdLine, const TCHAR *opt,
+	const TCHAR *default_fn, int (*test_fn)(const TCHAR *fn), int *pret)
+{
+	TCHAR buf[MAX_PATH];
+	int optlen;
+	int len;
+
+	optlen=lstrlen(opt);
+	if(_tcsnicmp(lpCmdLine,opt,optlen)) return 0;
+	if(lpCmdLine[optlen]!=' ' && lpCmdLine[optlen]!='\0') return 0;
+
+	lpCmdLine += optlen;
+	while(*lpCmdLine==' ') lpCmdLine++;
+
+	if(lpCmdLine[0]=='"') { // if quoted, strip quotes
+		StringCbCopy(buf,sizeof(buf),&lpCmdLine[1]);
+		len = lstrlen(buf);
+		if(len>0 && buf[len-1]=='"') buf[len-1]='\0';
+	}
+	else {
+		StringCbCopy(buf,sizeof(buf),lpCmdLine);
+	}
+	if(!buf[0]) StringCbCopy(buf,sizeof(buf),default_fn);
+
+	*pret = test_fn(buf);
+	return 1;
+}
+
+// Copy the next (possibly quoted) argument from the command line into buf.
+// Returns a pointer to the rest of the command line, or NULL if there are
+// no more arguments.
+static const TCHAR *next_cmdline_arg(const TCHAR *p, TCHAR *buf, int buflen)
+{
+	int n=0;
+	int quoted=0;
+
+	while(*p==' ') p++;
+	if(!*p) return NULL;
+
+	if(*p=='"') { quoted=1; p++; }
+	while(*p && (quoted ? *p!='"' : *p!=' ')) {
+		if(n<buflen-1) buf[n++]=*p;
+		p++;
+	}
+	if(quoted && *p=='"') p++;
+	buf[n]='\0';
+	return p;
+}
+
+// "-mkbig <file> <megabytes>" writes a PNG file of about that size, for
+// testing, without opening a window (see twpng_make_big_png()). Returns 1
+// if that was the command line, and sets *pret to the process exit code.
+static int run_cmdline_mkbig(const TCHAR *lpCmdLine, int *pret)
+{
+	TCHAR fn[MAX_PATH];
+	TCHAR buf[40];
+	const TCHAR *p;
+	ULONGLONG size;
+
+	if(_tcsnicmp(lpCmdLine,_T("-mkbig"),6)) return 0;
+	if(lpCmdLine[6]!=' ') return 0;
+
+	p=next_cmdline_arg(&lpCmdLine[6],fn,MAX_PATH);
+	if(p) p=next_cmdline_arg(p,buf,40);
+	if(!p || buf[0]<'0' || buf[0]>'9') {
+		mesg(MSG_E,_T("Usage: tweakpng -mkbig <file> <megabytes>"));
+		*pret=1;
+		return 1;
+	}
+	size=(ULONGLONG)_tcstoul(buf,NULL,10)*1024*1024;
+
+	*pret = twpng_make_big_png(fn,size) ? 0 : 1;
+	return 1;
+}
+
+// Give a file a twPd chunk of len bytes (or remove its twPd chunks, if len
+// is 0), without loading it. The new file is written under a temporary
+// name, and then replaces the old one.
+// Returns 1 on success, and 0 (leaving the file alone) if it has no IDAT
+// chunk to put the padding before.
+static int pad_file(const TCHAR *fn, DWORD len)
+{
+	TCHAR dir[MAX_PATH];
+	TCHAR tmpfn[MAX_PATH];
+	TCHAR msg[256];
+	TCHAR *base;
+	HANDLE infh, outfh;
+	ChunkFilter *f;
+	int ret;
+
+	if(!GetFullPathName(fn,MAX_PATH,dir,&base) || !base) return 0;
+	*base='\0';  // chop off the filename
+	if(!GetTempFileName(dir,_T("twp"),0,tmpfn)) return 0;
+
+	infh=CreateFile(fn,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,NULL);
+	if(infh==INVALID_HANDLE_VALUE) {
+		DeleteFile(tmpfn);
+		return 0;
+	}
+	outfh=CreateFile(tmpfn,GENERIC_WRITE,0,NULL,CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,NULL);
+	if(outfh==INVALID_HANDLE_VALUE) {
+		CloseHandle(infh);
+		DeleteFile(tmpfn);
+		return 0;
+	}
+
+	twpng_reset_quiet_mesg();
+	f=new ChunkFilter();
+	ret = f->set_padding(len) && f->run(twpng_file_read_fn,(void*)infh,outfh);
+	delete f;
+	// If there was no IDAT, run() only warns, and leaves the padding out.
+	if(ret && twpng_get_quiet_mesg(msg,256)) ret=0;
+	if(ret) ret = FlushFileBuffers(outfh) ? 1 : 0;
+	CloseHandle(outfh);
+	CloseHandle(infh);
+
+	if(ret) twpng_copy_file_attributes(fn,tmpfn);
+	if(ret) ret = MoveFileEx(tmpfn,fn,MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH) ? 1 : 0;
+	if(!ret) DeleteFile(tmpfn);
+	return ret;
+}
+
+// "-pad <bytes> <file>..." sets the size of the twPd chunk in each file,
+// without opening a window. Returns 1 if that was the command line, and
+// sets *pret to the process exit code: the number of files that couldn't
+// be changed.
+static int run_cmdline_pad(const TCHAR *lpCmdLine, int *pret)
+{
+	TCHAR buf[MAX_PATH];
+	const TCHAR *p;
+	DWORD len;
+	int num_failed=0;
+
+	if(_tcsnicmp(lpCmdLine,_T("-pad"),4)) return 0;
+	if(lpCmdLine[4]!=' ') return 0;
+
+	p=next_cmdline_arg(&lpCmdLine[4],buf,MAX_PATH);
+	if(!p || buf[0]<'0' || buf[0]>'9') {
+		mesg(MSG_E,_T("Usage: tweakpng -pad <bytes> <file>..."));
+		*pret=1;
+		return 1;
+	}
+	len=(DWORD)_tcstoul(buf,NULL,10);
+
+	twpng_set_quiet_mesg(1);
+	while((p=next_cmdline_arg(p,buf,MAX_PATH))) {
+		if(!pad_file(buf,len)) num_failed++;
+	}
+	twpng_set_quiet_mesg(0);
+
+	*pret=num_failed;
+	return 1;
+}
+
+// Write a line to a "-scan" or "-probe" report. Filenames are written as UTF-8.
+static void report_printf(HANDLE fh, const TCHAR *fmt, ...)
+{
+	TCHAR buf[1000];
+	DWORD written;
+	va_list ap;
+#ifdef UNICODE
+	char *s;
+	int slen;
+#endif
+
+	va_start(ap,fmt);
+	StringCchVPrintf(buf,1000,fmt,ap);
+	va_end(ap);
+#ifdef UNICODE
+	if(!convert_utf16_to_utf8(buf,lstrlen(buf),&s,&slen)) return;
+	WriteFile(fh,(LPVOID)s,(DWORD)slen,&written,NULL);
+	free(s);
+#else
+	WriteFile(fh,(LPVOID)buf,(DWORD)lstrlen(buf),&written,NULL);
+#endif
+}
 
-	return 1;
+// Add the files named by arg, which may contain wildcards, to bl.
+// Returns the number of files added.
+static int batch_add_files(BatchLoader *bl, const TCHAR *arg)
+{
+	WIN32_FIND_DATA fd;
+	HANDLE h;
+	TCHAR fn[MAX_PATH];
+	const TCHAR *base;
+	int n=0;
+
+	if(!_tcspbrk(arg,_T("*?"))) return (bl->add(arg)>=0) ? 1 : 0;
+
+	// FindFirstFile only returns the names, so keep the folder part.
+	base = &arg[lstrlen(arg)];
+	while(base>arg && base[-1]!='\\' && base[-1]!='/' && base[-1]!=':') base--;
+
+	h=FindFirstFile(arg,&fd);
+	if(h==INVALID_HANDLE_VALUE) return 0;
+	do {
+		if(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+		StringCchCopyN(fn,MAX_PATH,arg,base-arg);
+		StringCchCat(fn,MAX_PATH,fd.cFileName);
+		if(bl->add(fn)>=0) n++;
+	} while(FindNextFile(h,&fd));
+	FindClose(h);
+	return n;
 }
 
-static void ReadSettings()
+// "<opt> <report> <file>..." loads each file (the names may contain
+// wildcards) with the given flags, on a group of threads, without opening
+// a window, and writes a tab-separated line about each one to the report
+// file, in the order they finish. Returns 1 if that was the command line,
+// and sets *pret to the process exit code: the number of files that
+// couldn't be loaded or had problems.
+static int run_cmdline_load(const TCHAR *lpCmdLine, const TCHAR *opt,
+	unsigned int loadflags, int *pret)
 {
-	HKEY key;
-	LONG r;
-	DWORD datasize,tmpd;
+	TCHAR reportfn[MAX_PATH];
+	TCHAR buf[MAX_PATH];
+	TCHAR msgbuf[256];
+	const TCHAR *p;
+	const TCHAR *result;
+	const TCHAR *imgtype;
+	BatchLoader *bl;
+	struct twpng_batch_result res;
+	HANDLE fh;
+	LARGE_INTEGER freq, t0, t1;
+	ULONGLONG total_bytes=0;
+	double secs;
+	int optlen;
+	int num_files=0;
+	int num_failed=0;
 	int i;
-	TCHAR v[24];
-	//prefs_t tmp_prefs;
 
-	globals.compression_level=Z_DEFAULT_COMPRESSION;
-	globals.use_gamma=1;
-	globals.custombgcolor = RGB(128,128,128);
-	globals.use_custombg = 1;
-	globals.use_imagebg = 1;
-	for(i=0;i<16;i++) globals.custcolors[i] = RGB(0,0,0);
-	globals.autoopen_viewer=0;
-	globals.window_bgcolor=TWPNG_WBG_SAMEASIMAGE;
+	optlen=lstrlen(opt);
+	if(_tcsnicmp(lpCmdLine,opt,optlen)) return 0;
+	if(lpCmdLine[optlen]!=' ') return 0;
 
-	for(i=0;i<TWPNG_NUMTOOLS;i++) {
-		StringCchCopy(globals.tools[i].name,MAX_TOOL_NAME,_T(""));
-		StringCchCopy(globals.tools[i].cmd,MAX_TOOL_CMD,_T(""));
-		StringCchCopy(globals.tools[i].params,MAX_TOOL_PARAMS,_T(""));
+	p=next_cmdline_arg(&lpCmdLine[optlen],reportfn,MAX_PATH);
+	if(!p) {
+		mesg(MSG_E,_T("Usage: tweakpng %s <report> <file>..."),opt);
+		*pret=1;
+		return 1;
 	}
-	StringCchCopy(globals.tools[0].name,MAX_TOOL_NAME,_T("Default viewer"));
-	globals.window_prefs.version = 1;
-	globals.window_prefs.column_width[0]=50;
-	globals.window_prefs.column_width[1]=60;
-	globals.window_prefs.column_width[2]=60;
-	globals.window_prefs.column_width[3]=130;
-	globals.window_prefs.column_width[4]=600;
 
-	globals.window_prefs.main.x=0;
-	globals.window_prefs.main.y=0;
-	globals.window_prefs.main.w=600;
-	globals.window_prefs.main.h=300;
-	globals.window_prefs.main.max=0;
+	fh=CreateFile(reportfn,GENERIC_WRITE,0,NULL,CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,NULL);
+	if(fh==INVALID_HANDLE_VALUE) {
+		mesg(MSG_E,_T("Can") SYM_RSQUO _T("t write file (%s)"),reportfn);
+		*pret=1;
+		return 1;
+	}
+	report_printf(fh,_T("file\tresult\ttype\twidth\theight\tdepth\tcolor\tchunks\tbytes\tmessages\tmessage\n"));
 
-	globals.window_prefs.text.x=0;
-	globals.window_prefs.text.y=0;
-	globals.window_prefs.text.w=500;
-	globals.window_prefs.text.h=300;
-	globals.window_prefs.text.max=0;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t0);
 
-	globals.window_prefs.plte.x=0;
-	globals.window_prefs.plte.y=0;
-	globals.window_prefs.plte.w=490;
-	globals.window_prefs.plte.h=440;
-	globals.window_prefs.plte.max=0;
+	bl=new BatchLoader(0,TWPNG_BATCH_MAX_BYTES,loadflags);
+	while((p=next_cmdline_arg(p,buf,MAX_PATH))) {
+		if(!batch_add_files(bl,buf)) {
+			report_printf(fh,_T("%s\tFAIL\t\t\t\t\t\t\t\t1\tNo such file\n"),buf);
+			num_failed++;
+		}
+	}
 
-	globals.window_prefs.viewer.x=0;
-	globals.window_prefs.viewer.y=100;
-	globals.window_prefs.viewer.w=350;
-	globals.window_prefs.viewer.h=250;
-	globals.window_prefs.viewer.max=0;
+	if(!bl->start()) {
+		report_printf(fh,_T("# Failed to start loading\n"));
+		num_failed++;
+	}
+	else while(bl->get_next(&res)) {
+		num_files++;
 
-	if(RegOpenKeyEx(HKEY_CURRENT_USER,globals.twpng_reg_key,0,KEY_READ,&key)
-		!= ERROR_SUCCESS) return;
+		// Keep the report one line per file.
+		StringCchCopy(msgbuf,256,res.message);
+		for(i=0;msgbuf[i];i++) {
+			if(msgbuf[i]=='\t' || msgbuf[i]=='\r' || msgbuf[i]=='\n') msgbuf[i]=' ';
+		}
 
-	for(i=0;i<TWPNG_NUMTOOLS;i++) {
-		StringCchPrintf(v,24,_T("tool%dn"),i); datasize= sizeof(TCHAR)*(MAX_TOOL_NAME-1);
-		r=RegQueryValueEx(key,v,NULL,NULL,(LPBYTE)globals.tools[i].name,&datasize);
-		globals.tools[i].name[MAX_TOOL_NAME-1]='\0';
+		if(!res.png) {
+			report_printf(fh,_T("%s\tFAIL\t\t\t\t\t\t\t\t%d\t%s\n"),
+				res.fn,res.num_messages,msgbuf);
+			num_failed++;
+			continue;
+		}
 
-		StringCchPrintf(v,24,_T("tool%dc"),i); datasize= sizeof(TCHAR)*(MAX_TOOL_CMD-1);
-		r=RegQueryValueEx(key,v,NULL,NULL,(LPBYTE)globals.tools[i].cmd,&datasize);
-		globals.tools[i].cmd[MAX_TOOL_CMD-1]='\0';
+		result = _T("ok");
+		if(res.num_messages) {
+			result = _T("warn");
+			num_failed++;
+		}
+		switch(res.png->m_imgtype) {
+		case IMG_MNG: imgtype=_T("MNG"); break;
+		case IMG_JNG: imgtype=_T("JNG"); break;
+		default: imgtype=_T("PNG");
+		}
+		total_bytes += res.png->m_pngfilesize;
 
-		StringCchPrintf(v,24,_T("tool%dp"),i); datasize= sizeof(TCHAR*)*(MAX_TOOL_PARAMS-1);
-		r=RegQueryValueEx(key,v,NULL,NULL,(LPBYTE)globals.tools[i].params,&datasize);
-		globals.tools[i].params[MAX_TOOL_PARAMS-1]='\0';
+		report_printf(fh,_T("%s\t%s\t%s\t%u\t%u\t%d\t%d\t%d\t%I64u\t%d\t%s\n"),
+			res.fn,result,imgtype,(unsigned int)res.png->m_width,
+			(unsigned int)res.png->m_height,(int)res.png->m_bitdepth,
+			(int)res.png->m_colortype,res.png->m_num_chunks,
+			res.png->m_pngfilesize,res.num_messages,msgbuf);
+		delete res.png;
 	}
+	delete bl;
 
-	datasize=sizeof(globals.compression_level);
-	r=RegQueryValueEx(key,_T("deflate_lvl"),NULL,NULL,(LPBYTE)&globals.compression_level,&datasize);
+	QueryPerformanceCounter(&t1);
+	secs = (double)(t1.QuadPart-t0.QuadPart)/(double)freq.QuadPart;
+	report_printf(fh,_T("# %d files, %I64u bytes, %.3f seconds, %.1f files/s\n"),
+		num_files,total_bytes,secs,secs>0.0 ? (double)num_files/secs : 0.0);
+	CloseHandle(fh);
 
-	datasize=sizeof(globals.window_prefs);
-	r=RegQueryValueEx(key,_T("windowpos"),NULL,NULL,(LPBYTE)(&globals.window_prefs),&datasize);
+	*pret=num_failed;
+	return 1;
+}
 
-	datasize=sizeof(DWORD);
-	r=RegQueryValueEx(key,_T("show_viewer"),NULL,NULL,(LPBYTE)(&globals.autoopen_viewer),&datasize);
+// "-resave <file>..." loads each file (the names may contain wildcards)
+// and saves it again, without opening a window. This corrects wrong crcs.
+// Returns 1 if that was the command line, and sets *pret to the process
+// exit code: the number of files that couldn't be loaded or saved.
+static int run_cmdline_resave(const TCHAR *lpCmdLine, int *pret)
+{
+	TCHAR buf[MAX_PATH];
+	const TCHAR *p;
+	BatchLoader *bl;
+	BatchSaver *bs;
+	struct twpng_batch_result res;
+	int num_added=0;
+	int num_failed=0;
+	int n;
 
-	datasize=sizeof(DWORD);
-	r=RegQueryValueEx(key,_T("use_gamma"),NULL,NULL,(LPBYTE)(&globals.use_gamma),&datasize);
-	datasize=sizeof(DWORD);
-	r=RegQueryValueEx(key,_T("use_custombg"),NULL,NULL,(LPBYTE)(&globals.use_custombg),&datasize);
-	datasize=sizeof(DWORD);
-	r=RegQueryValueEx(key,_T("use_imagebg"),NULL,NULL,(LPBYTE)(&globals.use_imagebg),&datasize);
-	datasize=sizeof(DWORD);
-	r=RegQueryValueEx(key,_T("windowbg"),NULL,NULL,(LPBYTE)(&globals.window_bgcolor),&datasize);
-	datasize=sizeof(DWORD);
-	r=RegQueryValueEx(key,_T("zoom"),NULL,NULL,(LPBYTE)(&globals.vsize),&datasize);
+	if(_tcsnicmp(lpCmdLine,_T("-resave"),7)) return 0;
+	if(lpCmdLine[7]!=' ') return 0;
 
-	datasize=sizeof(DWORD);
-	r=RegQueryValueEx(key,_T("bgcolor"),NULL,NULL,(LPBYTE)&tmpd,&datasize);
-	if(r==ERROR_SUCCESS) {
-		globals.custombgcolor = (COLORREF)tmpd;
+	bl=new BatchLoader(0,TWPNG_BATCH_MAX_BYTES,TWPNG_LOAD_MAPPED);
+	p=&lpCmdLine[7];
+	while((p=next_cmdline_arg(p,buf,MAX_PATH))) {
+		n=batch_add_files(bl,buf);
+		if(n) num_added+=n;
+		else num_failed++;
 	}
 
-	datasize = 16*sizeof(COLORREF);
-	r=RegQueryValueEx(key,_T("custcolors"),NULL,NULL,(LPBYTE)(&globals.custcolors),&datasize);
-	RegCloseKey(key);
+	twpng_set_quiet_mesg(1);
+	bs=new BatchSaver(0);
+	if(!bl->start()) {
+		num_failed+=num_added;
+	}
+	else while(bl->get_next(&res)) {
+		if(!res.png) {
+			num_failed++;
+			continue;
+		}
+		// The file stays mapped until the Png is deleted, but it isn't
+		// replaced until its group is committed, after that.
+		if(bs->add(res.png,res.fn)<0) num_failed++;
+		delete res.png;
+	}
+	num_failed += bs->finish();
+	delete bs;
+	delete bl;
+	twpng_set_quiet_mesg(0);
+
+	*pret=num_failed;
+	return 1;
 }
 
 // Sets globals.file_from_cmdline.
@@ -1191,6 +3211,13 @@ static void get_filename_from_cmdline(const TCHAR *lpCmdLine)
 		StringCbCopy(buf,sizeof(buf),lpCmdLine);
 	}
 
+	// "-" means to read the file from standard input.
+	if(!lstrcmp(buf,_T("-"))) {
+		globals.stdin_from_cmdline=1;
+		StringCchCopy(globals.file_from_cmdline,MAX_PATH,_T(""));
+		return;
+	}
+
 	// Figure out the full filename.
 	ret = GetFullPathName(buf,MAX_PATH,globals.file_from_cmdline,NULL);
 	if(!ret) {
@@ -1204,6 +3231,14 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdL
 	HACCEL hAccTable;
 	int p;
 
+	if(run_cmdline_selftest(lpCmdLine,_T("-crctest"),_T("crctest.txt"),crc_selftest,&p)) return p;
+	if(run_cmdline_selftest(lpCmdLine,_T("-iotest"),_T("iotest.txt"),io_selftest,&p)) return p;
+	if(run_cmdline_mkbig(lpCmdLine,&p)) return p;
+	if(run_cmdline_pad(lpCmdLine,&p)) return p;
+	if(run_cmdline_load(lpCmdLine,_T("-scan"),TWPNG_LOAD_MAPPED,&p)) return p;
+	if(run_cmdline_load(lpCmdLine,_T("-probe"),TWPNG_LOAD_PROBE,&p)) return p;
+	if(run_cmdline_resave(lpCmdLine,&p)) return p;
+
 	ZeroMemory(&globals,sizeof(struct globals_struct));
 
 	globals.hInst=hInstance;
@@ -1248,8 +3283,6 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdL
 
 	get_filename_from_cmdline(lpCmdLine);
 
-	make_crc_table();
-
 	StringCchCopy(globals.orig_dir,MAX_PATH,_T(""));
 	StringCchCopy(globals.home_dir,MAX_PATH,_T(""));
 
@@ -1363,6 +3396,7 @@ static void SetTitle(Png *p)
 // Unconditionally close the current document, and update the UI.
 static void ClosePngDocument()
 {
+	StopWatching();
 	if(png) {
 		delete png;
 		png=NULL;
@@ -1378,6 +3412,7 @@ static void ClosePngDocument()
 // Unconditionally close the current document, and create a new empty document.
 static void NewPng()
 {
+	StopWatching();
 	if(png) {
 		delete png;
 		png=NULL;
@@ -1391,19 +3426,13 @@ static void NewPng()
 	update_status_bar_and_viewer();
 }
 
-// handles loading a new png file
-static int OpenPngByName(const TCHAR *fn)
+// Finishes loading a new png file, after the Png object has been created.
+static int AfterPngLoaded()
 {
-	if(png) {
-		delete png;
-		png=NULL;
-	}
-	ListView_DeleteAllItems(globals.hwndMainList);
-	png=new Png(fn, fn);
-
 	if(!png->m_valid) {
 		delete png;
 		png=NULL;
+		StopWatching();
 		SetTitle(NULL);
 		update_viewer_filename();
 		update_status_bar_and_viewer();
@@ -1414,11 +3443,45 @@ static int OpenPngByName(const TCHAR *fn)
 	SetTitle(png);
 	update_viewer_filename();
 	update_status_bar_and_viewer();
+	StartWatching();
 
 	return 1;
 }
 
-static int OpenPngFromMenu(HWND hwnd)
+// handles loading a new png file
+static int OpenPngByName(const TCHAR *fn, unsigned int extraflags)
+{
+	if(png) {
+		delete png;
+		png=NULL;
+	}
+	ListView_DeleteAllItems(globals.hwndMainList);
+	png=new Png(fn, fn, (globals.map_files?TWPNG_LOAD_MAPPED:0) |
+		(globals.lazy_load?TWPNG_LOAD_LAZY:0) | extraflags);
+	return AfterPngLoaded();
+}
+
+// Reads a png file from standard input (which is usually a pipe).
+static int OpenPngFromStdin()
+{
+	HANDLE fh;
+
+	fh=GetStdHandle(STD_INPUT_HANDLE);
+	if(fh==NULL || fh==INVALID_HANDLE_VALUE) {
+		mesg(MSG_E,_T("No standard input"));
+		return 0;
+	}
+
+	if(png) {
+		delete png;
+		png=NULL;
+	}
+	ListView_DeleteAllItems(globals.hwndMainList);
+	png=new Png(twpng_file_read_fn,(void*)fh);
+	return AfterPngLoaded();
+}
+
+static int OpenPngFromMenu(HWND hwnd, unsigned int extraflags)
 {
 	TCHAR fn[MAX_PATH];
 	OPENFILENAME ofn;
@@ -1450,7 +3513,7 @@ static int OpenPngFromMenu(HWND hwnd)
 	StringCchCopy(globals.last_open_dir,MAX_PATH,fn);
 	globals.last_open_dir[ofn.nFileOffset]='\0'; // chop off filename; save the path for next time
 
-	return OpenPngByName(fn);
+	return OpenPngByName(fn, extraflags);
 }
 
 static void ReopenPngDocument()
@@ -1470,7 +3533,141 @@ static void ReopenPngDocument()
 	// Use a copy of the filename, because OpenPngByName will
 	// delete the png object.
 	StringCbCopy(fn,sizeof(fn),png->m_filename);
-	OpenPngByName(fn);
+	OpenPngByName(fn,0);
+}
+
+// Watching the current file for changes made by other programs.
+//
+// A thread waits for change notifications on the file's directory, and
+// posts WM_TWPNG_FILECHANGED to the main window. That (re)starts a timer,
+// so that we don't try to read the file while it's still being written.
+// When the timer goes off, we check whether the file itself has changed,
+// and if so, refresh the document.
+
+static HANDLE watch_thread;
+static HANDLE watch_stop_event;
+static HANDLE watch_notify;
+static ULONGLONG watch_size;      // size of the file when we last looked
+static FILETIME watch_time;       // and its last-modified time
+
+// Returns 0 if the file's size and time can't be read.
+static int get_file_stamp(const TCHAR *fn, ULONGLONG *psize, FILETIME *ptime)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+
+	if(!GetFileAttributesEx(fn,GetFileExInfoStandard,(LPVOID)&fad)) return 0;
+	*psize = ((ULONGLONG)fad.nFileSizeHigh<<32) | fad.nFileSizeLow;
+	*ptime = fad.ftLastWriteTime;
+	return 1;
+}
+
+static DWORD WINAPI WatchThreadFn(LPVOID param)
+{
+	HANDLE h[2];
+
+	h[0]=watch_stop_event;
+	h[1]=watch_notify;
+	while(WaitForMultipleObjects(2,h,FALSE,INFINITE)==WAIT_OBJECT_0+1) {
+		PostMessage(globals.hwndMain,WM_TWPNG_FILECHANGED,0,0);
+		if(!FindNextChangeNotification(watch_notify)) break;
+	}
+	return 0;
+}
+
+static void StopWatching()
+{
+	if(watch_thread) {
+		SetEvent(watch_stop_event);
+		WaitForSingleObject(watch_thread,INFINITE);
+		CloseHandle(watch_thread);
+		watch_thread=NULL;
+	}
+	if(watch_notify) {
+		FindCloseChangeNotification(watch_notify);
+		watch_notify=NULL;
+	}
+	if(watch_stop_event) {
+		CloseHandle(watch_stop_event);
+		watch_stop_event=NULL;
+	}
+	KillTimer(globals.hwndMain,TWPNG_TIMER_WATCH);
+}
+
+// Start watching the current file, if that option is on. Also called after
+// the file is saved, so that we don't think someone else changed it.
+static void StartWatching()
+{
+	TCHAR dir[MAX_PATH];
+	TCHAR *base;
+
+	StopWatching();
+	if(!globals.watch_file || !png || !png->m_named) return;
+
+	if(!GetFullPathName(png->m_filename,MAX_PATH,dir,&base) || !base) return;
+	*base='\0';  // chop off the filename
+
+	if(!get_file_stamp(png->m_filename,&watch_size,&watch_time)) return;
+
+	watch_notify=FindFirstChangeNotification(dir,FALSE,
+		FILE_NOTIFY_CHANGE_FILE_NAME|FILE_NOTIFY_CHANGE_SIZE|FILE_NOTIFY_CHANGE_LAST_WRITE);
+	if(watch_notify==INVALID_HANDLE_VALUE) {
+		watch_notify=NULL;
+		return;
+	}
+	watch_stop_event=CreateEvent(NULL,TRUE,FALSE,NULL);
+	if(watch_stop_event) {
+		watch_thread=CreateThread(NULL,0,WatchThreadFn,NULL,0,NULL);
+	}
+	if(!watch_thread) StopWatching();
+}
+
+// Called when the watch timer goes off.
+static void WatchedFileChanged()
+{
+	ULONGLONG size;
+	FILETIME t;
+	TCHAR fn[MAX_PATH];
+	int kept;
+	int x;
+
+	if(!png || !png->m_named) return;
+	if(!get_file_stamp(png->m_filename,&size,&t)) return; // deleted, or being replaced
+	if(size==watch_size && !CompareFileTime(&t,&watch_time)) return; // some other file
+
+	if(globals.dlgs_open) {
+		// Don't pull the document out from under a dialog box. Try later.
+		SetTimer(globals.hwndMain,TWPNG_TIMER_WATCH,WATCH_DELAY,NULL);
+		return;
+	}
+
+	StringCbCopy(fn,sizeof(fn),png->m_filename);
+
+	if(png->m_dirty) {
+		// Only ask once for each change.
+		watch_size=size;
+		watch_time=t;
+		x=MessageBox(globals.hwndMain,_T("The file has been changed by another program.\n\n")
+			_T("Reload it and lose your changes?"),
+			_T("TweakPNG"),MB_YESNO|MB_ICONWARNING|MB_DEFBUTTON2);
+		if(x==IDYES) OpenPngByName(fn,0);
+		return;
+	}
+
+	switch(png->refresh(&kept)) {
+	case TWPNG_REFRESH_OK:
+		watch_size=size;
+		watch_time=t;
+		png->fill_listbox(globals.hwndMainList);
+		SetTitle(png);
+		update_status_bar_and_viewer();
+		break;
+	case TWPNG_REFRESH_BUSY:
+		SetTimer(globals.hwndMain,TWPNG_TIMER_WATCH,WATCH_DELAY,NULL);
+		break;
+	default:
+		OpenPngByName(fn,0);
+		break;
+	}
 }
 
 void DroppedFiles(HDROP hDrop)
@@ -1507,7 +3704,7 @@ void DroppedFiles(HDROP hDrop)
 	else {
 		// Assume this is a PNG/MNG/JNG file to be opened.
 		if(OkToClosePNG()) {
-			OpenPngByName(fn);
+			OpenPngByName(fn,0);
 		}
 	}
 
@@ -1542,6 +3739,11 @@ int Png::check_validity(int msgmode)
 
 	m=_T("No problems found.");
 
+	// Any crcs that weren't checked when the file was loaded (see
+	// TWPNG_LOAD_MAPPED) get checked now. Before saving, that's left to
+	// the save, which only checks the chunks it writes.
+	if(msgmode==0) verify_crcs(0);
+
 	if(m_imgtype!=IMG_PNG) {
 		if(msgmode==0) {
 			e++; m=_T("Can only check PNG files");
@@ -1771,6 +3973,7 @@ static int SavePngAs(HWND hwnd)
 			png->m_named=1;
 			png->m_dirty=0;
 			SetTitle(png);
+			StartWatching();
 			return 1;
 		}
 	}
@@ -1785,6 +3988,7 @@ static int SavePng(HWND hwnd)
 		if(png->write_file(png->m_filename)) {
 			png->m_dirty=0;
 			SetTitle(png);
+			StartWatching();
 			return 1;
 		}
 		return 0;
@@ -1877,7 +4081,8 @@ static void PasteChunks()
 	HGLOBAL hClip;
 	unsigned char* lpClip;
 	DWORD p;
-	int r,inspos1,inspos,numnewchunks;
+	DWORD *crcs;
+	int r,i,inspos1,inspos,numnewchunks;
 
 	inspos1=inspos=GetLVFocus(globals.hwndMainList);
 	numnewchunks=0;
@@ -1901,6 +4106,22 @@ static void PasteChunks()
 				p+=r;
 			}
 			GlobalUnlock(hClip);
+
+			// Calculate the new chunks' crcs all together.
+			crcs=(DWORD*)malloc(numnewchunks*sizeof(DWORD));
+			if(crcs) {
+				calc_chunk_crcs(&png->chunk[inspos1],numnewchunks,crcs);
+			}
+			for(i=0;i<numnewchunks;i++) {
+				if(crcs) {
+					png->chunk[inspos1+i]->m_crc=crcs[i];
+					png->chunk[inspos1+i]->m_crc_unverified=0;
+				}
+				else {
+					png->chunk[inspos1+i]->chunkmodified();
+				}
+			}
+			if(crcs) free(crcs);
 			png->fill_listbox(globals.hwndMainList);
 
 			// reselect the new or changed chunks
@@ -1930,6 +4151,10 @@ static int CopyChunks()
 	msize+=4;
 
 	hClip=GlobalAlloc(GMEM_MOVEABLE|GMEM_DDESHARE,msize);
+	if(!hClip) {
+		mesg(MSG_S,_T("Can") SYM_RSQUO _T("t allocate memory"));
+		return 0;
+	}
 	lpClip= (unsigned char*)GlobalLock(hClip);
 
 	// I don't know how to figure out the size of the clipboard data
@@ -1942,7 +4167,14 @@ static int CopyChunks()
 	p=4;
 	for(i=0;i<png->m_num_chunks;i++) {
 		if(ListView_GetItemState(globals.hwndMainList,i,LVIS_SELECTED) & LVIS_SELECTED) {
-			png->chunk[i]->copy_to_memory((unsigned char*)&lpClip[p]);
+			if(!png->chunk[i]->copy_to_memory((unsigned char*)&lpClip[p])) {
+				// Don't put a chunk with missing data on the clipboard.
+				GlobalUnlock(hClip);
+				GlobalFree(hClip);
+				mesg(MSG_E,_T("Can") SYM_RSQUO _T("t read the data of the %s chunk, so nothing was copied"),
+					png->chunk[i]->m_chunktype_tchar);
+				return 0;
+			}
 			p+= 12+png->chunk[i]->length;
 		}
 	}
@@ -1967,6 +4199,7 @@ static void ImportChunkByFilename(const TCHAR *fn, int pos)
 	HANDLE fh;
 	Chunk *c;
 	DWORD n;
+	LARGE_INTEGER filesize;
 
 	fh=CreateFile(fn,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,
 		FILE_ATTRIBUTE_NORMAL,NULL);
@@ -1975,8 +4208,16 @@ static void ImportChunkByFilename(const TCHAR *fn, int pos)
 		return;
 	}
 
+	if(!GetFileSizeEx(fh,&filesize) || filesize.QuadPart<4 ||
+		filesize.QuadPart-4 > TWPNG_MAX_CHUNK_LENGTH)
+	{
+		CloseHandle(fh);
+		mesg(MSG_E,_T("File is not a valid chunk file (%s)"),fn);
+		return;
+	}
+
 	c=new Chunk;
-	c->length=GetFileSize(fh,NULL)-4;
+	c->length=(DWORD)(filesize.QuadPart-4);
 	ReadFile(fh,(LPVOID)c->m_chunktype_ascii,4,&n,NULL);
 	c->m_chunktype_ascii[4]='\0';
 	c->set_chunktype_tchar_from_ascii();
@@ -2034,6 +4275,7 @@ static void ExportChunk()
 	OPENFILENAME ofn;
 	TCHAR fn[MAX_PATH];
 	HANDLE fh;
+	ChunkWriter *w;
 	int n;
 	BOOL bRet;
 
@@ -2066,7 +4308,11 @@ static void ExportChunk()
 			mesg(MSG_E,_T("Can") SYM_RSQUO _T("t create file"));
 		}
 		else {
-			png->chunk[n]->write_to_file(fh,1);
+			w=new ChunkWriter(fh);
+			if(!png->chunk[n]->write_to_file(w,1) || !w->flush()) {
+				mesg(MSG_E,_T("Error writing file"));
+			}
+			delete w;
 			CloseHandle(fh);
 		}
 	}
@@ -2141,8 +4387,11 @@ int Png::split_idat(int n, int ssize, int repeat)
 	int bytes_used;
 	int thissize;
 	TCHAR buf[200];
+	DWORD dcrc, prevcrc, thiscrc;
 
 	c=chunk[n];
+	if(!c->make_data_private()) return 0;
+	dcrc=c->get_data_crc();
 
 	// how many chunks will there be after the split
 	if(!repeat) {
@@ -2168,6 +4417,7 @@ int Png::split_idat(int n, int ssize, int repeat)
 	}
 
 	bytes_used=0;
+	prevcrc=0;  // crc of the data in the pieces so far
 
 	for(i=n;i<n+new_chunks;i++) {
 		if(i<n+new_chunks-1) {
@@ -2185,16 +4435,23 @@ int Png::split_idat(int n, int ssize, int repeat)
 		else {
 			chunk[i]->data = NULL;
 		}
+		chunk[i]->after_init();
+
+		if(i<n+new_chunks-1) {
+			thiscrc=CRCCOMPL(update_crc(CRCINIT,chunk[i]->data,thissize));
+			prevcrc=combine_crc(prevcrc,thiscrc,thissize);
+		}
+		else {
+			// The last piece's crc is what's left of the original crc
+			// after taking out the other pieces, so it isn't read again.
+			thiscrc=dcrc ^ combine_crc(prevcrc,0,thissize);
+		}
+		chunk[i]->set_data_crc(thiscrc);
 
 		bytes_used += thissize;
 	}
 
 	delete c;
-
-	for(i=n;i<n+new_chunks;i++) {
-		chunk[i]->after_init();
-		chunk[i]->chunkmodified();
-	}
 	modified();
 	fill_listbox(globals.hwndMainList);
 
@@ -2229,18 +4486,51 @@ static void SplitIDAT()
 
 }
 
+// Copy a chunk's data to buf. If its crc hasn't been checked yet, it's
+// checked during the copy, a piece at a time, instead of by reading all
+// the data again afterward.
+// Returns 0 on failure.
+static int copy_data_and_verify(Chunk *c, unsigned char *buf)
+{
+	DWORD ccrc;
+	DWORD pos, n;
+
+	if(!c->m_crc_unverified) return c->get_data_segment(0,buf,c->length);
+
+	ccrc=update_crc(CRCINIT,(unsigned char*)c->m_chunktype_ascii,4);
+	for(pos=0;pos<c->length;pos+=n) {
+		n=c->length-pos;
+		if(n>TWPNG_DEFERRED_BUFSIZE) n=TWPNG_DEFERRED_BUFSIZE;
+		if(!c->get_data_segment(pos,&buf[pos],n)) return 0;
+		ccrc=update_crc(ccrc,&buf[pos],n);
+	}
+	ccrc=CRCCOMPL(ccrc);
+	c->check_crc(ccrc);
+
+	// If a bit error was repaired, the data has changed.
+	if(c->m_crc!=ccrc) return c->get_data_segment(0,buf,c->length);
+	return 1;
+}
+
 static void CombineIDAT_range(int first, int last)
 {
+	ULONGLONG totallen;
 	DWORD len,pos;
+	DWORD dcrc;
 	int i;
 	unsigned char *newdata;
 	Chunk *c;
 
 	// calculate total length of data in new IDAT chunk
-	len=0;
+	totallen=0;
 	for(i=first;i<=last;i++) {
-		len+=png->chunk[i]->length;
+		totallen+=png->chunk[i]->length;
+	}
+	if(totallen>TWPNG_MAX_CHUNK_LENGTH) {
+		mesg(MSG_E,_T("The combined chunk would be too large"));
+		return;
 	}
+	len=(DWORD)totallen;
 
 	newdata= (unsigned char*)malloc(len);
 	if(!newdata) {
@@ -2248,13 +4538,20 @@ static void CombineIDAT_range(int first, int last)
 		return;
 	}
 
+	// The new crc is put together from the crcs of the pieces, so the data
+	// doesn't have to be read again. (Pieces whose crcs haven't been
+	// checked are checked as they're copied.)
 	pos=0;
+	dcrc=0;  // crc of no data
 	for(i=first;i<=last;i++) {
 		if(png->chunk[i]->length>0) {
-			memcpy((void*)&newdata[pos],
-				(void*)png->chunk[i]->data,png->chunk[i]->length);
+			if(!copy_data_and_verify(png->chunk[i],&newdata[pos])) {
+				free(newdata);
+				return;
+			}
 			pos+=png->chunk[i]->length;
 		}
+		dcrc=combine_crc(dcrc,png->chunk[i]->get_data_crc(),png->chunk[i]->length);
 	}
 
 	c=new Chunk;
@@ -2265,7 +4562,7 @@ static void CombineIDAT_range(int first, int last)
 	StringCchCopy(c->m_chunktype_tchar,5,png->chunk[first]->m_chunktype_tchar);
 	c->after_init();
 
-	c->chunkmodified();    // set crc
+	c->set_data_crc(dcrc);
 
 	for(i=first;i<=last;i++) {
 		delete png->chunk[i];
@@ -2675,7 +4972,7 @@ static void RunTool(int n)
 		StringCchPrintf(filt_infn,MAX_PATH+2,_T("%stwptemp1.%s"),tmpdirname,ext);
 		StringCchPrintf(filt_outfn,MAX_PATH+2,_T("%stwptemp2.%s"),tmpdirname,ext);
 
-		if(!png->write_file(filt_infn)) {
+		if(!png->write_file(filt_infn,TWPNG_WRITE_COPY)) {
 			goto done;
 		}
 
@@ -2713,7 +5010,7 @@ static void RunTool(int n)
 	}
 	else { // Tool is a viewer
 		StringCchPrintf(tmpname  ,MAX_PATH+2,_T("%stemp$$$$.%s"),tmpdirname,ext);
-		if(!png->write_file(tmpname)) {
+		if(!png->write_file(tmpname,TWPNG_WRITE_COPY)) {
 			goto done;
 		}
 
@@ -2881,8 +5178,11 @@ static LRESULT CALLBACK WndProcMain(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
 		// create the listview control, statusbar, etc.
 		if(!CreateMainWindows(hwnd)) return -1;  // abort program
 			
-		if(lstrlen(globals.file_from_cmdline)) {
-			OpenPngByName(globals.file_from_cmdline);
+		if(globals.stdin_from_cmdline) {
+			OpenPngFromStdin();
+		}
+		else if(lstrlen(globals.file_from_cmdline)) {
+			OpenPngByName(globals.file_from_cmdline,0);
 		}
 		if(globals.autoopen_viewer) {
 			PostMessage(hwnd,WM_COMMAND,ID_IMGVIEWER,(LPARAM)0);
@@ -2896,9 +5196,10 @@ static LRESULT CALLBACK WndProcMain(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
 
 	case WM_DESTROY:
 		if(globals.timer_set) {
-			KillTimer(hwnd,1);
+			KillTimer(hwnd,TWPNG_TIMER_VIEWER);
 			globals.timer_set=0;
 		}
+		StopWatching();
 		SaveSettings();
 		if(png) delete png;
 		png=NULL;
@@ -2931,13 +5232,22 @@ static LRESULT CALLBACK WndProcMain(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
 		return 0;
 
 	case WM_TIMER:
+		if(wParam==TWPNG_TIMER_WATCH) {
+			KillTimer(hwnd,TWPNG_TIMER_WATCH);
+			WatchedFileChanged();
+			return 0;
+		}
 		if(globals.timer_set) {
-			KillTimer(hwnd,1);
+			KillTimer(hwnd,TWPNG_TIMER_VIEWER);
 			globals.timer_set=0;
 		}
 		update_viewer();
 		return 0;
 
+	case WM_TWPNG_FILECHANGED:
+		SetTimer(hwnd,TWPNG_TIMER_WATCH,WATCH_DELAY,NULL);
+		return 0;
+
 	case WM_INITMENU:
 		{
 			HMENU m, mtools;
@@ -3018,6 +5328,14 @@ static LRESULT CALLBACK WndProcMain(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
 
 			CheckMenuItem(m,ID_IMGVIEWER,MF_BYCOMMAND|
 				(g_viewer?MF_CHECKED:MF_UNCHECKED));
+			CheckMenuItem(m,ID_MAPFILES,MF_BYCOMMAND|
+				(globals.map_files?MF_CHECKED:MF_UNCHECKED));
+			CheckMenuItem(m,ID_LAZYLOAD,MF_BYCOMMAND|
+				(globals.lazy_load?MF_CHECKED:MF_UNCHECKED));
+			CheckMenuItem(m,ID_WATCHFILE,MF_BYCOMMAND|
+				(globals.watch_file?MF_CHECKED:MF_UNCHECKED));
+			CheckMenuItem(m,ID_REPAIRCRC,MF_BYCOMMAND|
+				(globals.repair_crc?MF_CHECKED:MF_UNCHECKED));
 			return 0;
 		}
 
@@ -3063,7 +5381,11 @@ static LRESULT CALLBACK WndProcMain(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
 			if(OkToClosePNG()) DestroyWindow(hwnd);
 			return 0;
 		case ID_OPEN:
-			if(OkToClosePNG()) OpenPngFromMenu(hwnd);
+			if(OkToClosePNG()) OpenPngFromMenu(hwnd,0);
+			return 0;
+
+		case ID_OPENRECOVER:
+			if(OkToClosePNG()) OpenPngFromMenu(hwnd,TWPNG_LOAD_RECOVER);
 			return 0;
 		case ID_NEW:   
 			if(OkToClosePNG()) NewPng();
@@ -3090,6 +5412,25 @@ static LRESULT CALLBACK WndProcMain(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
 			globals.dlgs_open--;
 			return 0;
 
+		case ID_MAPFILES:
+			// Takes effect the next time a file is opened.
+			globals.map_files = !globals.map_files;
+			return 0;
+
+		case ID_LAZYLOAD:
+			globals.lazy_load = !globals.lazy_load;
+			return 0;
+
+		case ID_WATCHFILE:
+			globals.watch_file = !globals.watch_file;
+			StartWatching();  // or stop
+			return 0;
+
+		case ID_REPAIRCRC:
+			// Takes effect the next time a chunk's crc is checked.
+			globals.repair_crc = !globals.repair_crc;
+			return 0;
+
 		case ID_EDITTOOLS:
 			globals.dlgs_open++;
 			DialogBox(globals.hInst,_T("DLG_TOOLS"),globals.hwndMain,DlgProcTools);
@@ -3163,6 +5504,7 @@ static LRESULT CALLBACK WndProcMain(HWND hwnd, UINT msg, WPARAM wParam, LPARAM l
 		case ID_NEWTIME: png->new_chunk(CHUNK_tIME); return 0;
 		case ID_NEWTRNS: png->new_chunk(CHUNK_tRNS); return 0;
 		case ID_NEWVPAG: png->new_chunk(CHUNK_vpAg); return 0;
+		case ID_NEWTWPD: png->new_chunk(CHUNK_twPd); return 0;
 
 		case ID_CUT:    CutChunks();     return 0;
 		case ID_COPY:   CopyChunks();    return 0;
@@ -114,6 +114,9 @@
 #define CHUNK_CgBI 310
 #define CHUNK_vpAg 311
 
+// TweakPNG's own chunks
+#define CHUNK_twPd 320  // padding (see Png::absorb_padding())
+
 // registered PNG extensions:
 #define CHUNK_oFFs  501
 #define CHUNK_pCAL  502
@@ -130,6 +133,65 @@
 #define MSG_I 3 // information
 
 
+// Flags for the Png(load_fn,save_fn,loadflags) constructor
+#define TWPNG_LOAD_MAPPED  0x0001  // use a read-only view of the file, instead of reading it
+#define TWPNG_LOAD_LAZY    0x0002  // don't read image data (IDAT etc.) until it's needed
+#define TWPNG_LOAD_RECOVER 0x0004  // skip over damaged areas, instead of stopping (implies MAPPED)
+#define TWPNG_LOAD_PROBE   0x0008  // only read the chunks before the image data (see Png::m_partial)
+
+// Flags for Png::write_file()
+#define TWPNG_WRITE_COPY   0x0001  // a temporary copy; don't save in place, or remember its layout
+
+// When loading a mapped file, the crc is checked right away only for chunks
+// smaller than this. Checking the rest would mean touching every page of the file.
+#define TWPNG_MAPPED_CRC_LIMIT  65536
+// Chunk data that hasn't been loaded (TWPNG_LOAD_LAZY) is read from the
+// file in pieces of this size, when it doesn't need to be kept.
+#define TWPNG_DEFERRED_BUFSIZE  65536
+// Size of ChunkParser's buffer
+#define TWPNG_READBUF_SIZE  262144
+// Size of ChunkWriter's buffer. Chunk data this big or bigger is written
+// directly, without being copied.
+#define TWPNG_WRITEBUF_SIZE  1048576
+// Size of ChunkParser's buffer with TWPNG_LOAD_PROBE. The chunks before the
+// image data usually fit in this, so only one read is needed.
+#define TWPNG_PROBE_BUFSIZE  65536
+// When loading, crcs of chunks this large are calculated by a thread pool
+#define TWPNG_ASYNC_CRC_MIN  65536
+// Number of small chunks whose crcs are calculated together
+#define TWPNG_CRC_BATCH  64
+// Shortest buffer that update_crc() uses PCLMULQDQ for (must be at least 64)
+#define TWPNG_PCLMUL_CRC_MIN  256
+// Longest chunk (type+data) that is searched for a 1-bit error
+#define TWPNG_CRC_REPAIR_MAX  65536
+// Longest chunk (type+data) that is searched for 2-bit errors
+#define TWPNG_CRC_REPAIR2_MAX  128
+// Upper limit on the number of threads a BatchLoader will use
+#define TWPNG_BATCH_MAX_THREADS  64
+// How much file data "-scan" and "-probe" let their BatchLoader have in memory at once
+#define TWPNG_BATCH_MAX_BYTES  (256*1024*1024)
+// Default number of files a BatchSaver flushes to disk together
+#define TWPNG_SAVE_GROUP  64
+
+// The PNG spec limits chunk lengths to 2^31-1. Because of this, offsets
+// within a chunk can be DWORDs; offsets within a file have to be 64-bit.
+#define TWPNG_MAX_CHUNK_LENGTH  0x7fffffff
+
+// Chunk::m_filepos of a chunk that isn't in the file
+#define TWPNG_NO_FILEPOS  ((ULONGLONG)(-1))
+// When saving over the file in place, the chunks after the first one that
+// has moved are rewritten. If their data is still in the file, it is read
+// into memory first, unless there's more than this much of it; then the
+// whole file is written to a temporary file instead.
+#define TWPNG_INPLACE_MAX_TAIL  (64*1024*1024)
+// When looking for the next good chunk after damage (TWPNG_LOAD_RECOVER),
+// the crc of a candidate chunk is only checked if it is followed by the end
+// of the file or another plausible chunk header, or if it's no bigger
+// than this.
+#define TWPNG_RESYNC_UNLINKED_MAX  65536
+// Size of the data of a new twPd (padding) chunk
+#define TWPNG_PAD_SIZE  65536
+
 #define CRCCOMPL(c) ((c)^0xffffffff)
 #define CRCINIT (CRCCOMPL(0))
 
@@ -194,6 +256,10 @@ struct globals_struct {
 
 	COLORREF custcolors[16];
 	int autoopen_viewer;
+	int map_files;  // open files with TWPNG_LOAD_MAPPED
+	int lazy_load;  // open files with TWPNG_LOAD_LAZY
+	int watch_file; // reload the current file when another program changes it
+	int repair_crc; // fix 1- or 2-bit errors in chunks with bad crcs
 	HCURSOR hcurDrag2;
 	int viewer_imgpos_x, viewer_imgpos_y;
 	int viewer_correct_nonsquare;
@@ -208,18 +274,31 @@ struct globals_struct {
 	const TCHAR *twpng_reg_key;
 
 	TCHAR file_from_cmdline[MAX_PATH];
+	int stdin_from_cmdline;  // filename was "-"
 	TCHAR last_open_dir[MAX_PATH];
 	TCHAR home_dir[MAX_PATH];   // dir that tweakpng.exe is in
 	TCHAR orig_dir[MAX_PATH];   // current dir when program started
-	DWORD crc_table[256];       // table of CRCs of all 8-bit messages
 
 	tools_t tools[TWPNG_NUMTOOLS];
 
 	void *viewer_p2d_globals; // Used by the viewer
 };
 
+// A thread's quiet-mode setting and messages, saved by
+// twpng_push_quiet_mesg().
+struct twpng_quiet_state {
+	int quiet;
+	int count;
+	TCHAR buf[256];
+};
 
-DWORD update_crc(DWORD crc, unsigned char *buf, int len);
+DWORD update_crc(DWORD crc, unsigned char *buf, int len);  // in crc.cpp
+DWORD combine_crc(DWORD crc1, DWORD crc2, ULONGLONG len2);
+void update_crc_multi(int n, DWORD *crcs, unsigned char **bufs, const DWORD *lens);
+int find_crc_bit_errors(DWORD stored_crc, DWORD calc_crc, DWORD len, ULONGLONG *bitpos);
+int crc_selftest(const TCHAR *fn);
+int twpng_make_big_png(const TCHAR *fn, ULONGLONG size);  // in iotest.cpp
+int io_selftest(const TCHAR *fn);
 void write_int32(unsigned char *buf, DWORD x);
 DWORD read_int32(unsigned char *x);
 int read_int16(unsigned char *x);
@@ -228,6 +307,12 @@ int GetLVSelection(HWND hwnd);
 void SetLVSelection(HWND hwnd, int pos, int num);
 int get_name_from_id(char *name, int x);
 void mesg(int severity, const TCHAR *fmt, ...);
+int twpng_set_quiet_mesg(int quiet);
+void twpng_reset_quiet_mesg();
+void twpng_push_quiet_mesg(struct twpng_quiet_state *st);
+void twpng_pop_quiet_mesg(const struct twpng_quiet_state *st);
+void twpng_copy_file_attributes(const TCHAR *fromfn, const TCHAR *tofn);
+int twpng_get_quiet_mesg(TCHAR *buf, int buflen);
 int choose_color_dialog(HWND hwnd, unsigned char *redp,
 						unsigned char *greenp, unsigned char *bluep);
 void DroppedFiles(HDROP hDrop);
@@ -294,11 +379,158 @@ struct textdlgmetrics {
 struct edit_chunk_ctx {
 	Chunk *ch;
 	struct textdlgmetrics tdm;
+	unsigned char seqbuf[4];  // fdAT sequence number (the rest isn't edited)
 };
 
 int ImportICCProfileByFilename(Png *png, const TCHAR *fn);
 int ImportICCProfile(Png *png);
 
+// Return the number of bytes read (0 at the end of the input), or -1 on error.
+typedef int (*twpng_read_cb_type)(void *userdata, unsigned char *buf, DWORD nbytes);
+int twpng_file_read_fn(void *userdata, unsigned char *buf, DWORD nbytes);
+
+// Return values of ChunkParser::next_chunk()
+#define TWPNG_PARSE_STREAM     3  // got the length and type of an image data chunk (with TWPNG_PF_STREAMIMAGE)
+#define TWPNG_PARSE_IMAGE      2  // reached the image data (with TWPNG_PF_STOPATIMAGE)
+#define TWPNG_PARSE_CHUNK      1  // got a chunk
+#define TWPNG_PARSE_END        0  // normal end of input
+#define TWPNG_PARSE_TRUNCATED  -1 // input ended in the middle of a chunk
+#define TWPNG_PARSE_BADTYPE    -2
+#define TWPNG_PARSE_BADLENGTH  -3
+#define TWPNG_PARSE_NOMEM      -4
+#define TWPNG_PARSE_READERR    -5
+
+// Flags for ChunkParser::next_chunk()
+#define TWPNG_PF_DEFER       0x0001  // defer reading image data, if possible
+#define TWPNG_PF_NOLARGECRC  0x0002  // don't calculate the crc of chunks of TWPNG_ASYNC_CRC_MIN bytes or more
+#define TWPNG_PF_STOPATIMAGE 0x0004  // stop at the first IDAT, JDAT, or IEND chunk
+#define TWPNG_PF_NOCRC       0x0008  // don't calculate any crcs
+#define TWPNG_PF_STREAMIMAGE 0x0010  // leave image data, and its crc, to be read with read_data()
+
+// Return values of Png::refresh()
+#define TWPNG_REFRESH_OK       1
+#define TWPNG_REFRESH_FAILED   0  // the file has to be reloaded from scratch
+#define TWPNG_REFRESH_BUSY     -1 // another program has the file open; try again later
+
+struct crc_pool_item;
+
+// A damaged part of a file that was skipped by TWPNG_LOAD_RECOVER
+struct twpng_skipped_range {
+	ULONGLONG pos;
+	ULONGLONG len;
+	int next_chunk;  // index of the chunk that was found after it
+};
+
+class CrcPool {
+public:
+	CrcPool();
+	~CrcPool();
+	void add(Chunk *c);
+	void add_result(Chunk *c, DWORD ccrc);
+	void finish();
+
+private:
+	static DWORD WINAPI work_fn(LPVOID param);
+	struct crc_pool_item *new_item(Chunk *c);
+	void flush_batch();
+
+	struct crc_pool_item *m_batch[TWPNG_CRC_BATCH]; // small chunks not yet done
+	int m_batch_len;
+
+	struct crc_pool_item **m_items;
+	int m_num_items;
+	int m_items_alloc;
+	volatile LONG m_pending; // work items not finished, plus 1 until finish() is called
+	HANDLE m_done_event;
+};
+
+// Reads chunks one at a time from a file or any other byte source, and
+// calculates their crcs as they go by. Uses a read-ahead buffer, so that
+// reading a chunk doesn't take several reads of the source; large reads
+// bypass the buffer.
+class ChunkParser {
+public:
+	ChunkParser(HANDLE fh, ULONGLONG size, DWORD bufsize=TWPNG_READBUF_SIZE);
+	ChunkParser(twpng_read_cb_type read_fn, void *userdata);
+	~ChunkParser();
+
+	int read_signature(unsigned char *sig);
+	int next_chunk(Chunk *c, unsigned int flags, DWORD *pcrc);
+	int read_data(unsigned char *buf, DWORD len, DWORD *pcrc);
+	int seek(ULONGLONG pos);
+
+	ULONGLONG m_pos;       // number of bytes read (or skipped) so far
+	ULONGLONG m_chunkpos;  // position of the chunk next_chunk() last looked at
+
+private:
+	void init(twpng_read_cb_type read_fn, void *userdata, DWORD bufsize);
+	int read(unsigned char *buf, DWORD len, DWORD *pcrc);
+	int skip(ULONGLONG len);
+
+	twpng_read_cb_type m_read_fn;
+	void *m_userdata;
+	HANDLE m_fh;     // only if reading from a file
+	int m_seekable;
+	ULONGLONG m_size;
+	int m_size_known;
+	unsigned char *m_buf;  // NULL if we couldn't allocate it
+	DWORD m_bufsize;
+	DWORD m_buflen;  // number of valid bytes in m_buf
+	DWORD m_bufpos;  // number of those bytes that have been used
+};
+
+// Collects small writes, so that a file made of many small chunks can be
+// saved with a few big WriteFile calls.
+class ChunkWriter {
+public:
+	ChunkWriter(HANDLE fh, DWORD bufsize=TWPNG_WRITEBUF_SIZE);
+	~ChunkWriter();
+
+	int write(const unsigned char *buf, DWORD len);
+	int flush();
+	int seek(ULONGLONG pos);
+
+	int m_failed;    // set if any write failed
+
+private:
+	int write_direct(const unsigned char *buf, DWORD len);
+
+	HANDLE m_fh;
+	unsigned char *m_buf;  // NULL if we couldn't allocate it
+	DWORD m_bufsize;
+	DWORD m_buflen;  // number of bytes in m_buf waiting to be written
+};
+
+// One piece of a file, as it would be saved (see SerializedView).
+struct twpng_span {
+	const unsigned char *data;  // NULL if it has to be read with c->get_data_segment()
+	Chunk *c;                   // the chunk whose data this is, if data is NULL
+	DWORD len;
+};
+
+// The bytes of a file, as it would be saved, as a list of spans that point
+// to the chunks' own data instead of copying it. Only the chunk headers and
+// crcs are stored here, one after another, so a run of chunks with no data
+// is a single span. The view is only good until the chunks are changed.
+class SerializedView {
+public:
+	SerializedView(Png *png);
+	~SerializedView();
+
+	int m_valid;
+	int m_num_spans;
+	struct twpng_span *m_spans;
+	ULONGLONG m_size;  // total bytes in all the spans
+
+	int read(int i, DWORD offset, unsigned char *buf, DWORD len);
+	int write_to(ChunkWriter *w);
+
+private:
+	void add_span(const unsigned char *data, Chunk *c, DWORD len);
+
+	unsigned char *m_hdrbuf;  // signature, then length+type+crc of each chunk
+};
+
 class Chunk {
 public:
 	Chunk();
@@ -308,7 +540,7 @@ public:
 
 	void after_init();
 
-	int write_to_file(HANDLE fh, int exp);
+	int write_to_file(ChunkWriter *w, int exp);
 	void get_text_descr(TCHAR *buf, int buflen);    // buf must be 1000 chars or more
 	void get_text_descr_generic(TCHAR *buf, int buflen);    // buf must be 1000 chars or more
 	int get_chunk_type_id(); // convert type into an integer
@@ -321,6 +553,15 @@ public:
 
 
 	DWORD calc_crc();  // calculates CRC, does not modify it
+	void verify_crc(); // checks m_crc, and corrects it if wrong
+	void check_crc(DWORD ccrc); // same, given the calculated crc
+	int repair_bit_errors(DWORD ccrc);
+	DWORD get_data_crc();  // crc of the data alone, without the chunk type
+	void set_data_crc(DWORD dcrc); // sets m_crc, given the crc of the data
+	int overwrite_data(DWORD offset, const unsigned char *buf, DWORD len);
+	int make_data_private();
+	void free_data();
+	int get_data_segment(DWORD offset, unsigned char *buf, DWORD len);
 
 	int edit();  // generic edit; calls the right edit_*() function
 	int can_edit();  // Can this chunk normally be edited?
@@ -334,6 +575,13 @@ public:
 	unsigned char *data;
 	DWORD length;     /* length of the DATA field */
 	DWORD m_crc;
+	int m_data_mapped;    // data points into the parent's file view, and isn't ours to free
+	int m_crc_unverified; // m_crc was read from the file, but hasn't been checked yet
+	int m_data_deferred;  // data hasn't been read yet; it's at m_srcpos in the parent's source file
+	ULONGLONG m_srcpos;
+	ULONGLONG m_filepos;  // where the chunk starts in the parent's layout file, or TWPNG_NO_FILEPOS
+	DWORD m_filecrc;      // the crc stored there
+	int m_file_stale;     // the copy there is known to be different (it had a bad crc)
 	char m_chunktype_ascii[5];
 	TCHAR m_chunktype_tchar[5];
 	int m_chunktype_id;
@@ -391,21 +639,26 @@ private:
 	int msg_if_invalid_length(TCHAR *buf, int buflen, const TCHAR *name);
 };
 
+void calc_chunk_crcs(Chunk **c, int n, DWORD *ccrc);
+
 
 class Png {
+	friend class SerializedView;
 
 public:
-	Png(const TCHAR *load_fn, const TCHAR *save_fn);
+	Png(const TCHAR *load_fn, const TCHAR *save_fn, unsigned int loadflags=0);
+	Png(twpng_read_cb_type read_fn, void *userdata);
 	Png();
 
 	~Png();
 
 	int m_valid;
 
-	int write_file(const TCHAR *fn);
-	int write_to_mem(unsigned char **pmem, int *plen);
+	int write_file(const TCHAR *fn, unsigned int flags=0);
+	int write_to_handle(HANDLE fh);
 	void stream_file_start();
 	DWORD stream_file_read(unsigned char *buf, DWORD bytes);
+	void stream_file_end();
 	void fill_listbox(HWND hwnd);
 	void delete_chunk(int);
 	void move_chunk(int,int);
@@ -419,12 +672,16 @@ public:
 	void insert_chunks(int pos, int num, int init);
 	void new_chunk(int chunktype_id);
 	Chunk *find_first_chunk(int chunktype_id, int *index);
-	DWORD get_file_size();
+	ULONGLONG get_file_size();
+	int verify_crcs(int in_place);
+	int release_source_file();
+	int read_source(ULONGLONG pos, unsigned char *buf, DWORD len);
+	int refresh(int *pnum_kept);
 	
 
 	int m_imgtype;
 	int m_num_chunks;
-	DWORD m_pngfilesize;   // used when loading from disk
+	ULONGLONG m_pngfilesize;   // used when loading from disk
 
 	//info from the header
 	DWORD m_width;
@@ -442,13 +699,15 @@ public:
 	TCHAR m_filename[MAX_PATH];
 	int m_named;
 	int m_dirty; // has file been modified?
+	int m_partial; // loaded with TWPNG_LOAD_PROBE, so only the first chunks are here
 
 private:
 	int m_chunks_alloc;    /* alloc'd length of the chunk array */
+	void init_members();
 
-	int m_stream_phase; // 0=reading file signature, 1=reading chunks
-	int m_stream_curchunk;  // used by stream_file_read
-	DWORD m_stream_curpos_in_curchunk; // position in the current chunk, or in the file signature
+	SerializedView *m_stream_view;  // used by stream_file_read
+	int m_stream_span;  // the span we're reading
+	DWORD m_stream_pos; // position in that span
 
 
 	void update_row(HWND hwnd,int n);
@@ -457,9 +716,155 @@ private:
 
 	void init_new_chunk(int);
 
-	int read_signature(HANDLE fh);
-	int read_next_chunk(HANDLE fh, DWORD *filepos);
+	int read_signature(ChunkParser *p);
+	int read_next_chunk(ChunkParser *p, unsigned int pflags, CrcPool *crcpool);
+
+	// Used when loading with TWPNG_LOAD_MAPPED or TWPNG_LOAD_LAZY
+	TCHAR m_srcfilename[MAX_PATH];
+	HANDLE m_srcfh; // (lazy only) kept open until all chunks have been read
+	HANDLE m_srcmapping;
+	unsigned char *m_srcview;
+	int map_file(HANDLE fh);
+	int read_next_chunk_mapped(ULONGLONG *filepos, int recover, CrcPool *crcpool);
+	int check_mapped_chunk(ULONGLONG pos);
+
+	// Used when loading with TWPNG_LOAD_RECOVER
+	struct twpng_skipped_range *m_skipped;
+	int m_num_skipped;
+	int m_skipped_alloc;
+	ULONGLONG resync_mapped(ULONGLONG pos);
+	void add_skipped_range(ULONGLONG pos, ULONGLONG len);
+	void report_recovery();
+
+	// The file that the chunks' m_filepos values refer to (the one that was
+	// last loaded or saved), with its size and time then; "" if none.
+	TCHAR m_layoutfilename[MAX_PATH];
+	ULONGLONG m_layoutsize;
+	FILETIME m_layouttime;
+	int write_all(ChunkWriter *w);
+	int absorb_padding();
+	void set_layout(const TCHAR *fullfn);
+	int save_in_place(const TCHAR *fullfn);
+	int save_by_copying(const TCHAR *fullfn);
+	int save_by_replacing(const TCHAR *fullfn);
+	void detach_source();
+	int reattach_source(const TCHAR *fullfn);
+
+};
+
+struct twpng_batch_result {
+	int index;          // the value that BatchLoader::add() returned for this file
+	const TCHAR *fn;    // the filename that was given to add()
+	Png *png;           // NULL if the file couldn't be loaded
+	int num_messages;   // number of warnings/errors while loading
+	TCHAR message[256]; // the first of them
+};
+
+struct twpng_batch_job;
+
+class BatchLoader {
+public:
+	BatchLoader(int num_threads, ULONGLONG max_bytes, unsigned int loadflags);
+	~BatchLoader();
+
+	int add(const TCHAR *fn);
+	int start();
+	int get_next(struct twpng_batch_result *res);
+
+private:
+	static unsigned __stdcall thread_fn(void *param);
+	void run();
+
+	int m_num_threads;
+	ULONGLONG m_max_bytes;
+	unsigned int m_loadflags;
+
+	struct twpng_batch_job *m_jobs;
+	int m_num_jobs;
+	int m_jobs_alloc;
+	int m_next_job;     // next job for a thread to start
+	int *m_done;        // indices of finished jobs, in the order they finished
+	int m_num_done;
+	int m_num_taken;    // number of finished jobs returned by get_next()
+	ULONGLONG m_bytes_in_flight;
+	int m_started;
+	int m_cancel;
+
+	HANDLE *m_threads;
+	CRITICAL_SECTION m_lock;
+	HANDLE m_budget_event;  // set when m_bytes_in_flight goes down
+	HANDLE m_done_sem;      // count of finished jobs not yet returned
+};
+
+struct twpng_save_result {
+	int ok;             // 1 if the file was saved
+	TCHAR message[256]; // if not, why not
+};
+
+struct twpng_save_job;
+
+class BatchSaver {
+public:
+	BatchSaver(int group_size=0);
+	~BatchSaver();
+
+	int add(Png *png, const TCHAR *fn);
+	int finish();
+	int get_result(int index, struct twpng_save_result *res);
+
+private:
+	static DWORD WINAPI flush_fn(LPVOID param);
+	void commit_group();
+	void set_failed(struct twpng_save_job *job, const TCHAR *msg, const TCHAR *fn);
+
+	int m_group_size;
+	struct twpng_save_job *m_jobs;
+	int m_num_jobs;
+	int m_jobs_alloc;
+	int m_group_start;  // first job that hasn't been committed
+	volatile LONG m_pending; // flushes not finished, plus 1 while starting them
+	HANDLE m_done_event;
+};
+
+// Actions of ChunkFilter rules
+#define TWPNG_FILTER_DROP     1  // leave out chunks of this type
+#define TWPNG_FILTER_REPLACE  2  // replace the data of chunks of this type
+#define TWPNG_FILTER_INSERT   3  // insert a new chunk before the first chunk of this type
+
+struct twpng_filter_rule {
+	int action;          // TWPNG_FILTER_*
+	char type[5];        // the type of chunk it applies to
+	char newtype[5];     // the type of the chunk to insert
+	unsigned char *data; // the new chunk data (REPLACE and INSERT)
+	DWORD len;
+	int count;           // number of times it was applied
+};
+
+class ChunkFilter {
+public:
+	ChunkFilter();
+	~ChunkFilter();
+
+	int drop(const char *type);
+	int replace(const char *type, const unsigned char *data, DWORD len);
+	int insert_before(const char *type, const char *newtype, const unsigned char *data, DWORD len);
+	int set_padding(DWORD len);
+	int run(twpng_read_cb_type read_fn, void *userdata, HANDLE outfh);
 
+	int m_num_chunks;     // chunks read
+	int m_num_dropped;    // chunks left out (by rules, or because they may no longer be valid)
+	int m_num_crcs_fixed; // chunks whose crcs were wrong
+
+private:
+	int add_rule(int action, const char *type, const char *newtype, const unsigned char *data, DWORD len);
+	struct twpng_filter_rule *find_rule(int action, const char *type);
+	int write_chunk(ChunkWriter *w, const char *type, const unsigned char *data, DWORD len, DWORD crc);
+	int copy_image_data(ChunkParser *p, ChunkWriter *w, Chunk *c);
+
+	struct twpng_filter_rule *m_rules;
+	int m_num_rules;
+	int m_rules_alloc;
+	int m_critical_changed; // a rule replaces the data of a critical chunk
 };
 
 
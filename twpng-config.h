@@ -21,4 +21,15 @@
 #define TWPNG_HAVE_ZLIB
 #endif
 
+// SSE2 is used for scanning damaged files, if the processor has it.
+#if defined(_M_IX86) || defined(_M_X64)
+#define TWPNG_USE_SSE2
+#endif
+
+// PCLMULQDQ is used to calculate CRCs, if the processor has it. The
+// intrinsics need Visual C++ 2010 or later.
+#if (defined(_M_IX86) || defined(_M_X64)) && defined(_MSC_VER) && _MSC_VER>=1600
+#define TWPNG_USE_PCLMUL
+#endif
+
 #endif // TWPNG_CONFIG_H
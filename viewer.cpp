@@ -317,6 +317,7 @@ void Viewer::Update(Png *png1)
 
 abort:
 	if(p2d) p2d_done(p2d);
+	if(png1) png1->stream_file_end();
 
 	if(m_hwndViewer) {
 		InvalidateRect(m_hwndViewer,NULL,TRUE);